@@ -0,0 +1,24 @@
+#pragma once
+#include <stdexcept>
+#include <string>
+
+namespace toolkit {
+    /** @file
+     *  Parsing helpers shared by the command line tools
+     */
+    namespace helpers {
+        inline size_t parse_size(const std::string& size) {
+            /** Parse a size in bytes, optionally suffixed with K, M or G */
+            size_t pos;
+            size_t value = std::stoull(size, &pos);
+            std::string suffix = size.substr(pos);
+
+            if (suffix == "K" || suffix == "k") return value << 10;
+            if (suffix == "M" || suffix == "m") return value << 20;
+            if (suffix == "G" || suffix == "g") return value << 30;
+            if (!suffix.empty())
+                throw std::runtime_error("Invalid size: " + size);
+            return value;
+        }
+    }
+}
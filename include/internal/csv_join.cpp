@@ -0,0 +1,60 @@
+#include "csv_join.hpp"
+#include "cli_util.hpp"
+#include <cxxopts.hpp>
+#include <iostream>
+
+int main(int argc, char** argv) {
+    using namespace toolkit;
+
+    cxxopts::Options options(argv[0], "Join two CSV files");
+    options.positional_help("[file1] [file2] [out]");
+    options.add_options("required")
+        ("file1", "first input file", cxxopts::value<std::string>())
+        ("file2", "second input file", cxxopts::value<std::string>())
+        ("output", "output file", cxxopts::value<std::string>());
+    options.add_options("optional")
+        ("a,column1", "Join column in the first file (default: natural join)",
+            cxxopts::value<std::string>()->default_value(""))
+        ("b,column2", "Join column in the second file (default: column1)",
+            cxxopts::value<std::string>()->default_value(""))
+        ("t,type", "Type of join: inner, left or full",
+            cxxopts::value<std::string>()->default_value("inner"))
+        ("m,memory-limit", "Use an external sort-merge join if the smaller file would "
+            "take more than this much memory as a hash table, e.g. 8G (default: no limit)",
+            cxxopts::value<std::string>()->default_value("0"));
+    options.parse_positional({ "file1", "file2", "output" });
+
+    if (argc < 4) {
+        std::cout << options.help({ "optional" }) << std::endl;
+        exit(1);
+    }
+
+    try {
+        auto results = options.parse(argc, argv);
+
+        JoinOptions join_options = DEFAULT_JOIN;
+        auto type = results["type"].as<std::string>();
+        if (type == "inner")
+            join_options.type = JoinType::INNER;
+        else if (type == "left")
+            join_options.type = JoinType::LEFT;
+        else if (type == "full")
+            join_options.type = JoinType::FULL;
+        else
+            throw std::runtime_error("Unknown join type: " + type);
+
+        join_options.memory_limit = helpers::parse_size(results["memory-limit"].as<std::string>());
+
+        toolkit::csv_join(results["file1"].as<std::string>(),
+            results["file2"].as<std::string>(),
+            results["output"].as<std::string>(),
+            results["column1"].as<std::string>(),
+            results["column2"].as<std::string>(), join_options);
+    }
+    catch (std::exception& err) {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,366 @@
+#pragma once
+#include <csv_parser.hpp>
+#include "csv_sort.hpp"
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace toolkit {
+    enum class JoinType {
+        INNER, /**< Rows with a match in both files */
+        LEFT,  /**< Every row of the first file */
+        FULL   /**< Every row of both files */
+    };
+
+    struct JoinOptions {
+        JoinType type;
+        size_t memory_limit; /**< If the smaller file would take more than this many
+                              *   bytes in a hash table, use an external sort-merge
+                              *   join instead (0: no limit) */
+    };
+
+    const JoinOptions DEFAULT_JOIN = {
+        JoinType::INNER,
+        0
+    };
+
+    namespace helpers {
+        /** Column positions of the join keys and the output layout of a join */
+        struct JoinPlan {
+            std::vector<size_t> keys1;     /**< Key columns in the first file */
+            std::vector<size_t> keys2;     /**< Key columns in the second file */
+            std::vector<size_t> output2;   /**< Columns of the second file written out */
+            std::vector<std::string> col_names;
+            bool natural;                  /**< Keys are written once, from either file */
+        };
+
+        inline size_t join_col_index(const std::vector<std::string>& col_names,
+            const std::string& name, const std::string& filename) {
+            auto it = std::find(col_names.begin(), col_names.end(), name);
+            if (it == col_names.end())
+                throw std::runtime_error("Can't find a column named " + name + " in " + filename);
+            return (size_t)(it - col_names.begin());
+        }
+
+        inline JoinPlan join_plan(const std::string& filename1, const std::string& filename2,
+            const std::vector<std::string>& names1, const std::vector<std::string>& names2,
+            const std::string& column1, const std::string& column2) {
+            /** Work out which columns to join on and which to write. With no join
+             *  columns this is a natural join on every column name the files have
+             *  in common, which are written once. Otherwise, every column of both
+             *  files is written.
+             */
+            JoinPlan plan;
+            plan.natural = column1.empty() && column2.empty();
+            plan.col_names = names1;
+
+            if (plan.natural) {
+                for (size_t i = 0; i < names2.size(); i++) {
+                    auto it = std::find(names1.begin(), names1.end(), names2[i]);
+                    if (it == names1.end()) {
+                        plan.output2.push_back(i);
+                        plan.col_names.push_back(names2[i]);
+                    }
+                    else {
+                        plan.keys1.push_back((size_t)(it - names1.begin()));
+                        plan.keys2.push_back(i);
+                    }
+                }
+
+                if (plan.keys1.empty())
+                    throw std::runtime_error("Natural join: " + filename1 + " and "
+                        + filename2 + " have no column names in common");
+            }
+            else {
+                plan.keys1 = { join_col_index(names1, column1.empty() ? column2 : column1, filename1) };
+                plan.keys2 = { join_col_index(names2, column2.empty() ? column1 : column2, filename2) };
+
+                for (size_t i = 0; i < names2.size(); i++) {
+                    plan.output2.push_back(i);
+                    plan.col_names.push_back(names2[i]);
+                }
+            }
+
+            return plan;
+        }
+
+        inline std::string join_key(const Row& row, const std::vector<size_t>& keys) {
+            /** Encode the key columns of a row as one hashable string.
+             *  Each part is length-prefixed so composite keys can't collide.
+             */
+            static const std::string missing;
+            std::string key;
+            for (size_t i: keys) {
+                const std::string& field = i < row.size() ? row[i] : missing;
+                key += std::to_string(field.size());
+                key += ':';
+                key += field;
+            }
+
+            return key;
+        }
+
+        inline bool has_null_key(const Row& row, const std::vector<size_t>& keys) {
+            /** Whether any key column of a row is empty (or missing). Like
+             *  NULL in SQL, an empty key never matches anything, not even
+             *  another empty key.
+             */
+            for (size_t i: keys) {
+                if (i >= row.size() || row[i].empty())
+                    return true;
+            }
+
+            return false;
+        }
+
+        inline int compare_keys(const Row& row1, const std::vector<size_t>& keys1,
+            const Row& row2, const std::vector<size_t>& keys2) {
+            /** Compare the key columns of two rows, which may come from different files */
+            static const std::string missing;
+            for (size_t i = 0; i < keys1.size(); i++) {
+                const std::string& field1 = keys1[i] < row1.size() ? row1[keys1[i]] : missing;
+                const std::string& field2 = keys2[i] < row2.size() ? row2[keys2[i]] : missing;
+                int cmp = field1.compare(field2);
+                if (cmp) return cmp;
+            }
+
+            return 0;
+        }
+
+        /** Rough number of bytes a hash table entry takes beyond its key:
+         *  the node, its list of row numbers and a bucket pointer
+         */
+        const size_t HASH_ENTRY_OVERHEAD = sizeof(std::string) + sizeof(std::vector<size_t>) + 4 * sizeof(void *);
+
+        template<typename Write>
+        bool hash_join(csv::CSVReader& reader1, csv::CSVReader& reader2, const JoinPlan& plan,
+            bool build_first, bool keep_first, bool keep_second, size_t memory_limit,
+            std::vector<Row>& build_rows, Write write_joined) {
+            /** Load one file into a hash table keyed on the join columns,
+             *  and stream the other file through it
+             *
+             *  @returns False, without writing anything, if the hash table
+             *           would take more than memory_limit bytes (0: no limit).
+             *           build_rows is then left holding the rows read from
+             *           the start of the file that was being loaded.
+             */
+            csv::CSVReader& build_reader = build_first ? reader1 : reader2;
+            csv::CSVReader& probe_reader = build_first ? reader2 : reader1;
+            auto& build_keys = build_first ? plan.keys1 : plan.keys2;
+            auto& probe_keys = build_first ? plan.keys2 : plan.keys1;
+
+            std::unordered_map<std::string, std::vector<size_t>> table;
+            size_t footprint = 0;
+
+            for (auto& row: build_reader) {
+                build_rows.push_back(row);
+                footprint += row_footprint(build_rows.back()) + sizeof(size_t);
+
+                if (!has_null_key(build_rows.back(), build_keys)) {
+                    auto entry = table.emplace(join_key(build_rows.back(), build_keys), std::vector<size_t>());
+                    if (entry.second)
+                        footprint += entry.first->first.size() + HASH_ENTRY_OVERHEAD;
+                    entry.first->second.push_back(build_rows.size() - 1);
+                }
+
+                if (memory_limit && footprint > memory_limit)
+                    return false;
+            }
+
+            // Which side's unmatched rows are also written
+            const bool keep_build = build_first ? keep_first : keep_second;
+            const bool keep_probe = build_first ? keep_second : keep_first;
+            std::vector<bool> matched(keep_build ? build_rows.size() : 0, false);
+            const Row empty;
+
+            for (auto& csv_row: probe_reader) {
+                Row row = csv_row;
+                auto match = has_null_key(row, probe_keys) ? table.end() : table.find(join_key(row, probe_keys));
+
+                if (match == table.end()) {
+                    if (keep_probe)
+                        build_first ? write_joined(empty, row) : write_joined(row, empty);
+                    continue;
+                }
+
+                for (size_t i: match->second) {
+                    if (keep_build) matched[i] = true;
+                    build_first ? write_joined(build_rows[i], row) : write_joined(row, build_rows[i]);
+                }
+            }
+
+            // Rows from the hash table which were never matched
+            for (size_t i = 0; i < matched.size(); i++) {
+                if (!matched[i])
+                    build_first ? write_joined(build_rows[i], empty) : write_joined(empty, build_rows[i]);
+            }
+
+            return true;
+        }
+
+        template<typename Write>
+        void sort_merge_join(csv::CSVReader& reader1, csv::CSVReader& reader2, const JoinPlan& plan,
+            bool keep_first, bool keep_second, size_t memory_limit, Write write_joined,
+            std::vector<Row> read1 = {}, std::vector<Row> read2 = {}) {
+            /** Sort both files by their join columns, spilling to disk so that
+             *  neither file needs to fit in memory, then merge them. Rows are
+             *  written in key order. Only the rows of the second file sharing
+             *  any one key are held in memory at the same time.
+             *
+             *  read1 and read2 are rows already read from the start of each
+             *  file, e.g. by a hash join which ran out of memory.
+             */
+            auto sort_file = [](csv::CSVReader& reader, std::vector<Row>& read, ExternalSorter& sorter) {
+                for (auto& row: read)
+                    sorter.push(std::move(row));
+                std::vector<Row>().swap(read);
+
+                for (auto& row: reader)
+                    sorter.push(row);
+                sorter.sort();
+            };
+
+            auto by_keys = [](const std::vector<size_t>& keys) {
+                return [&keys](const Row& left, const Row& right) {
+                    return compare_keys(left, keys, right, keys) < 0;
+                };
+            };
+
+            // Each sorter gets half of the budget, since both are resident
+            ExternalSorter sorter1(by_keys(plan.keys1), memory_limit / 2);
+            ExternalSorter sorter2(by_keys(plan.keys2), memory_limit / 2);
+            sort_file(reader1, read1, sorter1);
+            sort_file(reader2, read2, sorter2);
+
+            const Row empty;
+            Row row1, row2;
+            std::vector<Row> group;
+            bool has1 = sorter1.next(row1), has2 = sorter2.next(row2);
+
+            while (has1 || has2) {
+                // Rows with an empty key match nothing
+                if (has1 && has_null_key(row1, plan.keys1)) {
+                    if (keep_first) write_joined(row1, empty);
+                    has1 = sorter1.next(row1);
+                    continue;
+                }
+                else if (has2 && has_null_key(row2, plan.keys2)) {
+                    if (keep_second) write_joined(empty, row2);
+                    has2 = sorter2.next(row2);
+                    continue;
+                }
+
+                int cmp = !has1 ? 1 : (!has2 ? -1 :
+                    compare_keys(row1, plan.keys1, row2, plan.keys2));
+
+                if (cmp < 0) {
+                    if (keep_first) write_joined(row1, empty);
+                    has1 = sorter1.next(row1);
+                }
+                else if (cmp > 0) {
+                    if (keep_second) write_joined(empty, row2);
+                    has2 = sorter2.next(row2);
+                }
+                else {
+                    // Gather every row of the second file with this key
+                    group.clear();
+                    group.push_back(row2);
+                    while ((has2 = sorter2.next(row2)) &&
+                        compare_keys(row2, plan.keys2, group.front(), plan.keys2) == 0)
+                        group.push_back(row2);
+
+                    do {
+                        for (auto& match: group)
+                            write_joined(row1, match);
+                        has1 = sorter1.next(row1);
+                    } while (has1 && compare_keys(row1, plan.keys1, group.front(), plan.keys2) == 0);
+                }
+            }
+        }
+    }
+
+    inline void csv_join(std::string filename1, std::string filename2, std::string outfile,
+        std::string column1 = "", std::string column2 = "",
+        const JoinOptions& opts = DEFAULT_JOIN) {
+        /** Join two CSV files and write the result as a CSV file
+         *  @param[in]  column1 Join column in the first file
+         *  @param[in]  column2 Join column in the second file (default: column1).
+         *                      If neither is given, the files are naturally
+         *                      joined on the column names they have in common.
+         *
+         *  As in SQL, where empty fields would be NULL, rows whose join
+         *  columns are empty never match, but are still written by outer
+         *  joins.
+         *
+         *  The smaller file is loaded into a hash table keyed on the join
+         *  columns, and the larger one is streamed through it, so only one
+         *  of the two files needs to fit in memory. If the hash table grows
+         *  past opts.memory_limit (as it will if the smaller file is larger
+         *  than that on disk), both files are sorted externally and merged
+         *  instead.
+         */
+        using namespace csv;
+        using helpers::Row;
+
+        CSVReader reader1(filename1), reader2(filename2);
+        auto plan = helpers::join_plan(filename1, filename2,
+            reader1.get_col_names(), reader2.get_col_names(), column1, column2);
+
+        auto file_size = [](const std::string& filename) {
+            std::ifstream infile(filename, std::ios::binary | std::ios::ate);
+            return (size_t)infile.tellg();
+        };
+
+        const size_t size1 = file_size(filename1), size2 = file_size(filename2);
+
+        std::ofstream out(outfile, std::ios::binary);
+        auto writer = make_csv_writer(out);
+        writer.write_row(plan.col_names);
+
+        const size_t n_cols1 = reader1.get_col_names().size();
+        Row out_row;
+
+        auto write_joined = [&](const Row& row1, const Row& row2) {
+            /** Write a row of output, where one of the two rows may be empty */
+            out_row.assign(row1.begin(), row1.end());
+            out_row.resize(n_cols1);
+
+            // A natural join's key columns may only be present in the second row
+            if (plan.natural && row1.empty()) {
+                for (size_t i = 0; i < plan.keys1.size(); i++) {
+                    if (plan.keys2[i] < row2.size())
+                        out_row[plan.keys1[i]] = row2[plan.keys2[i]];
+                }
+            }
+
+            for (size_t i: plan.output2)
+                out_row.push_back(i < row2.size() ? row2[i] : "");
+
+            writer.write_row(out_row);
+        };
+
+        const bool keep_first = opts.type != JoinType::INNER;
+        const bool keep_second = opts.type == JoinType::FULL;
+
+        // Rows take up more memory than they do on disk, so don't try a hash
+        // join if the smaller file is over the limit before it's even parsed
+        const bool build_first = size1 <= size2;
+        std::vector<Row> build_rows;
+        if (opts.memory_limit && std::min(size1, size2) > opts.memory_limit) {
+            helpers::sort_merge_join(reader1, reader2, plan,
+                keep_first, keep_second, opts.memory_limit, write_joined);
+        }
+        else if (!helpers::hash_join(reader1, reader2, plan, build_first,
+            keep_first, keep_second, opts.memory_limit, build_rows, write_joined)) {
+            if (build_first)
+                helpers::sort_merge_join(reader1, reader2, plan, keep_first, keep_second,
+                    opts.memory_limit, write_joined, std::move(build_rows));
+            else
+                helpers::sort_merge_join(reader1, reader2, plan, keep_first, keep_second,
+                    opts.memory_limit, write_joined, {}, std::move(build_rows));
+        }
+    }
+}
@@ -1,4 +1,5 @@
 #include "csv_json.hpp"
+#include "cli_util.hpp"
 #include <cxxopts.hpp>
 #include <iostream>
 #include <fstream>
@@ -11,6 +12,14 @@ int main(int argc, char** argv) {
     options.add_options("required")
         ("input", "input file", cxxopts::value<std::string>())
         ("output", "output file", cxxopts::value<std::string>());
+    options.add_options("optional")
+        ("l,lines", "Write newline-delimited JSON, one object per line")
+        ("c,columns", "Write one object mapping each column to an array of its values")
+        ("m,memory-limit", "With --columns, spill values to temporary files past this "
+            "many bytes, e.g. 1G (0: no limit)",
+            cxxopts::value<std::string>()->default_value("256M"))
+        ("j,threads", "Convert rows to JSON on n threads",
+            cxxopts::value<size_t>()->default_value("1"));
     options.parse_positional({ "input", "output" });
 
     if (argc < 3) {
@@ -21,10 +30,21 @@ int main(int argc, char** argv) {
     try {
         auto results = options.parse(argc, argv);
 
-        std::ofstream out(argv[2]);
-        toolkit::csv_to_json(argv[1], out);
+        JSONOptions json_options = DEFAULT_JSON;
+        if (results["lines"].as<bool>() && results["columns"].as<bool>())
+            throw std::runtime_error("--lines and --columns are mutually exclusive");
+        else if (results["lines"].as<bool>())
+            json_options.format = JSONFormat::LINES;
+        else if (results["columns"].as<bool>())
+            json_options.format = JSONFormat::COLUMNS;
+
+        json_options.memory_limit = helpers::parse_size(results["memory-limit"].as<std::string>());
+        json_options.threads = results["threads"].as<size_t>();
+
+        std::ofstream out(results["output"].as<std::string>());
+        toolkit::csv_to_json(results["input"].as<std::string>(), out, json_options);
     }
-    catch (std::runtime_error& err) {
+    catch (std::exception& err) {
         std::cout << "Error: " << err.what() << std::endl;
     }
 
@@ -1,53 +1,456 @@
 #include <csv_parser.hpp>
-#include <json.hpp>
+#include "csv_parallel.hpp"
+#include "string_scan.hpp"
+#include "temp_file.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <memory>
 #include <string>
 #include <sstream>
+#include <vector>
+
+#if defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
 
 namespace toolkit {
-    using json = nlohmann::json;
+    namespace helpers {
+        inline void json_escape(std::string& out, csv::string_view str) {
+            /** Append str to out as a quoted JSON string */
+            static const char hex[] = "0123456789abcdef";
+            out += '"';
+
+            while (!str.empty()) {
+                size_t safe = json_safe_prefix(str.data(), str.size());
+                out.append(str.data(), safe);
+                if (safe == str.size())
+                    break;
+
+                unsigned char ch = (unsigned char)str[safe];
+                switch (ch) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\b': out += "\\b"; break;
+                case '\f': out += "\\f"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    out += "\\u00";
+                    out += hex[ch >> 4];
+                    out += hex[ch & 0xF];
+                }
+
+                str.remove_prefix(safe + 1);
+            }
+
+            out += '"';
+        }
+
+        inline bool is_json_number(csv::string_view str) {
+            /** Whether str is a number as JSON spells it, i.e.
+             *  -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+             */
+            size_t i = 0, n = str.size();
+            auto digits = [&]() {
+                size_t start = i;
+                while (i < n && str[i] >= '0' && str[i] <= '9') i++;
+                return i - start;
+            };
+
+            if (i < n && str[i] == '-') i++;
+            if (i < n && str[i] == '0') i++;
+            else if (!digits()) return false;
+
+            if (i < n && str[i] == '.') {
+                i++;
+                if (!digits()) return false;
+            }
+
+            if (i < n && (str[i] == 'e' || str[i] == 'E')) {
+                i++;
+                if (i < n && (str[i] == '+' || str[i] == '-')) i++;
+                if (!digits()) return false;
+            }
+
+            return i == n;
+        }
+
+        inline void json_integer(std::string& out, long long int value) {
+            char buffer[24];
+#ifdef __cpp_lib_to_chars
+            auto end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+            out.append(buffer, end);
+#else
+            out.append(buffer, (size_t)snprintf(buffer, sizeof(buffer), "%lld", value));
+#endif
+        }
+
+        inline void json_double(std::string& out, double value) {
+            /** Append the shortest representation of value which round trips */
+            if (!std::isfinite(value)) {
+                out += "null";
+                return;
+            }
+
+            char buffer[32];
+#ifdef __cpp_lib_to_chars
+            size_t len = (size_t)(std::to_chars(buffer, buffer + sizeof(buffer), value).ptr - buffer);
+#else
+            size_t len = (size_t)snprintf(buffer, sizeof(buffer), "%.17g", value);
+#endif
+            out.append(buffer, len);
+
+            // Keep floats recognizable as such, e.g. 3.0 rather than 3
+            if (csv::string_view(buffer, len).find_first_of(".e") == csv::string_view::npos)
+                out += ".0";
+        }
+    }
+
+    /** Serializes CSV rows as JSON objects straight into a text buffer.
+     *  Column positions are resolved and keys are escaped once, from the
+     *  header, instead of once per row.
+     */
+    class JSONRowPlan {
+    public:
+        JSONRowPlan(const std::vector<std::string>& col_names) {
+            for (size_t i = 0; i < col_names.size(); i++) {
+                // As with a JSON object, a repeated column name keeps the last value
+                auto& name = col_names[i];
+                if (std::find(col_names.begin() + i + 1, col_names.end(), name) != col_names.end())
+                    continue;
+
+                std::string key = this->columns.empty() ? "{" : ",";
+                helpers::json_escape(key, name);
+                key += ':';
+
+                this->columns.push_back(i);
+                this->keys.push_back(key);
+            }
+        }
+
+        void write(csv::CSVRow& row, std::string& out) const {
+            /** Append row to out as a JSON object */
+            for (size_t i = 0; i < this->columns.size(); i++) {
+                out += this->keys[i];
+                this->write_value(row, i, out);
+            }
+
+            out += this->columns.empty() ? "{}" : "}";
+        }
+
+        void write_value(csv::CSVRow& row, size_t i, std::string& out) const {
+            /** Append the value of the i-th written column of row to out */
+            using namespace csv;
+            size_t col = this->columns[i];
+
+            if (col >= row.size()) {
+                out += "null"; // Missing fields
+                return;
+            }
+
+            CSVField field = row[col];
+            switch (field.type()) {
+            case CSV_DOUBLE:
+            case CSV_LONG_LONG_INT:
+            case CSV_LONG_INT:
+            case CSV_INT:
+                write_number(field, out);
+                break;
+            default:
+                helpers::json_escape(out, field.get<string_view>());
+            }
+        }
+
+        /** Number of columns written */
+        size_t size() const { return this->columns.size(); }
+
+        /** Pre-escaped "key": of the i-th written column, preceded by { or , */
+        const std::string& key(size_t i) const { return this->keys[i]; }
+
+    private:
+        static void write_number(csv::CSVField& field, std::string& out) {
+            /** Copy the field's text if it is already a valid JSON number,
+             *  otherwise format its parsed value
+             */
+            auto text = field.get<csv::string_view>();
+            while (!text.empty() && text.front() == ' ') text.remove_prefix(1);
+            while (!text.empty() && text.back() == ' ') text.remove_suffix(1);
+
+            if (helpers::is_json_number(text))
+                out.append(text.data(), text.size());
+            else if (field.type() == csv::CSV_DOUBLE)
+                helpers::json_double(out, field.get<double>());
+            else
+                helpers::json_integer(out, field.get<long long int>());
+        }
+
+        std::vector<size_t> columns;   /**< Columns which are written */
+        std::vector<std::string> keys; /**< Pre-escaped "key": for each column */
+    };
+
+    enum class JSONFormat {
+        ARRAY,  /**< One array of row objects */
+        LINES,  /**< Newline-delimited JSON: one row object per line */
+        COLUMNS /**< One object mapping each column name to an array of values */
+    };
+
+    struct JSONOptions {
+        JSONFormat format;
+        size_t memory_limit; /**< JSONFormat::COLUMNS: Bytes of column values held in
+                              *   memory before spilling to temporary files (0: no limit) */
+        size_t threads;      /**< Number of threads converting rows to JSON */
+    };
+
+    const JSONOptions DEFAULT_JSON = {
+        JSONFormat::ARRAY,
+        256 * 1024 * 1024,
+        1
+    };
+
+    /** Bytes of JSON buffered before being written to the output stream */
+    const size_t JSON_BUFFER_SIZE = 64 * 1024;
+
+    namespace helpers {
+        /** The comma-separated JSON values of one column, kept in memory
+         *  until spill() moves them to a segment of a temporary file shared
+         *  by every column
+         */
+        class JSONColumn {
+        public:
+            std::string& buffer() {
+                /** Text to append the next value to, after a separator if needed */
+                if (this->has_values)
+                    this->values += ',';
+                this->has_values = true;
+                return this->values;
+            }
+
+            void append(const std::string& values) {
+                /** Append several comma-separated values at once */
+                if (!values.empty())
+                    this->buffer() += values;
+            }
+
+            void spill(TempFile& file) {
+                if (this->values.empty())
+                    return;
+
+                this->segments.emplace_back(file.size(), this->values.size());
+                file.write(this->values.data(), this->values.size());
+                this->values.clear();
+            }
+
+            template<typename OutputStream>
+            void copy_to(OutputStream& out, TempFile * file) {
+                /** Write every value appended so far, in order, reading any
+                 *  spilled ones back from file
+                 */
+                for (auto& segment : this->segments)
+                    file->copy_to(out, segment.first, segment.second);
+                out.write(this->values.data(), this->values.size());
+            }
+
+        private:
+            std::string values;
+            bool has_values = false;
+            std::vector<std::pair<size_t, size_t>> segments; /**< Offset and length of each spill */
+        };
+
+        /** Buffers the values of every column for {"col": [v1, v2, ...], ...}
+         *  output. Whenever the buffers' total size reaches memory_limit,
+         *  all of them are spilled to one temporary file, so that only one
+         *  file is open however many columns there are.
+         */
+        class JSONColumns {
+        public:
+            JSONColumns(const JSONRowPlan& plan, size_t memory_limit) :
+                plan(plan), columns(plan.size()), memory_limit(memory_limit) {}
+
+            void append(csv::CSVRow& row) {
+                for (size_t i = 0; i < this->columns.size(); i++) {
+                    std::string& values = this->columns[i].buffer();
+                    size_t before = values.size();
+                    this->plan.write_value(row, i, values);
+                    this->buffered += values.size() - before;
+                }
+
+                this->check_limit();
+            }
+
+            void append(const std::vector<std::string>& chunk) {
+                /** Append the comma-separated values of several rows, per column */
+                for (size_t i = 0; i < this->columns.size(); i++) {
+                    this->columns[i].append(chunk[i]);
+                    this->buffered += chunk[i].size();
+                }
+
+                this->check_limit();
+            }
+
+            template<typename OutputStream>
+            void write(OutputStream& out) {
+                for (size_t i = 0; i < this->columns.size(); i++) {
+                    const std::string& key = this->plan.key(i);
+                    out.write(key.data(), key.size());
+                    out.write("[", 1);
+                    this->columns[i].copy_to(out, this->spill_file.get());
+                    out.write("]", 1);
+                }
+
+                if (this->columns.empty())
+                    out.write("{}", 2);
+                else
+                    out.write("}", 1);
+            }
+
+        private:
+            void check_limit() {
+                if (this->memory_limit && this->buffered >= this->memory_limit) {
+                    if (!this->spill_file)
+                        this->spill_file.reset(new TempFile());
+                    for (auto& column : this->columns)
+                        column.spill(*this->spill_file);
+                    this->buffered = 0;
+                }
+            }
+
+            const JSONRowPlan& plan;
+            std::vector<JSONColumn> columns;
+            size_t memory_limit;
+            size_t buffered = 0;
+            std::unique_ptr<TempFile> spill_file;
+        };
+
+        template<typename OutputStream>
+        void csv_to_json_parallel(const std::string& in, const csv::CSVFormat& format,
+            const JSONRowPlan& plan, OutputStream& out, const JSONOptions& opts) {
+            /** Convert record-aligned chunks of a CSV file to JSON text on
+             *  opts.threads worker threads, while the calling thread writes
+             *  the chunks out in file order
+             */
+            using Range = RecordRanges::Range;
+            RecordRanges ranges(in, format);
+            const size_t max_in_flight = 2 * opts.threads;
+
+            if (opts.format == JSONFormat::COLUMNS) {
+                JSONColumns columns(plan, opts.memory_limit);
+
+                auto convert = [&](Range& range) {
+                    std::vector<std::string> values(plan.size());
+                    read_range(in, range.first, range.second, ranges.get_format(),
+                        [&](csv::CSVRow& row) {
+                        for (size_t i = 0; i < values.size(); i++) {
+                            if (!values[i].empty())
+                                values[i] += ',';
+                            plan.write_value(row, i, values[i]);
+                        }
+                    });
+                    return values;
+                };
+
+                auto write = [&](std::vector<std::string>& values) { columns.append(values); };
+
+                parallel_ordered<Range, std::vector<std::string>>(opts.threads, max_in_flight,
+                    std::ref(ranges), convert, write);
+                columns.write(out);
+                return;
+            }
+
+            const bool lines = opts.format == JSONFormat::LINES;
+            bool first_chunk = true;
+
+            auto convert = [&](Range& range) {
+                std::string text;
+                read_range(in, range.first, range.second, ranges.get_format(),
+                    [&](csv::CSVRow& row) {
+                    if (!lines && !text.empty())
+                        text += ",\n";
+                    plan.write(row, text);
+                    if (lines)
+                        text += '\n';
+                });
+                return text;
+            };
+
+            auto write = [&](std::string& text) {
+                if (text.empty())
+                    return;
+
+                if (!lines)
+                    out.write(first_chunk ? "[" : ",\n", first_chunk ? 1 : 2);
+                first_chunk = false;
+                out.write(text.data(), text.size());
+            };
+
+            parallel_ordered<Range, std::string>(opts.threads, max_in_flight,
+                std::ref(ranges), convert, write);
+
+            if (!lines)
+                out.write(first_chunk ? "[\n]" : "\n]", first_chunk ? 3 : 2);
+        }
+    }
 
     template<typename OutputStream>
-    void csv_to_json(const std::string& in, OutputStream& out) {
-        /** Convert a CSV file to JSON */
+    void csv_to_json(const std::string& in, OutputStream& out, const JSONOptions& opts = DEFAULT_JSON) {
+        /** Convert a CSV file to JSON
+         *
+         *  With JSONFormat::LINES, every row is written as a complete object
+         *  terminated by a newline, so the output can be consumed (or split)
+         *  line by line without parsing the whole document.
+         *
+         *  With JSONFormat::COLUMNS, each key is written once, followed by
+         *  an array of that column's values.
+         *
+         *  If opts.threads > 1, rows are converted on that many threads.
+         *  The output is the same either way.
+         */
         using namespace csv;
         CSVReader reader(in);
-        auto col_names = reader.get_col_names();
+        JSONRowPlan plan(reader.get_col_names());
+
+        if (opts.threads > 1) {
+            CSVFormat format = reader.get_format();
+            format.col_names = reader.get_col_names();
+            helpers::csv_to_json_parallel(in, format, plan, out, opts);
+            return;
+        }
+
+        if (opts.format == JSONFormat::COLUMNS) {
+            helpers::JSONColumns columns(plan, opts.memory_limit);
+            for (auto& row : reader)
+                columns.append(row);
+            columns.write(out);
+            return;
+        }
 
-        out << "[";
+        const bool lines = opts.format == JSONFormat::LINES;
+        std::string buffer = lines ? "" : "[";
+        buffer.reserve(JSON_BUFFER_SIZE * 2);
         bool first_row = true;
 
         for (auto& row : reader) {
             if (first_row)
                 first_row = false;
-            else
-                out << ",\n";
-
-            json record;
-            for (auto& name : col_names) {
-                DataType type = row[name].type();
-                
-                switch (type) {
-                case CSV_DOUBLE:
-                    record[name] = row[name].get<double>();
-                    break;
-                case CSV_LONG_LONG_INT:
-                    record[name] = row[name].get<long long int>();
-                    break;
-                case CSV_LONG_INT:
-                    record[name] = row[name].get<long int>();
-                    break;
-                case CSV_INT:
-                    record[name] = row[name].get<int>();
-                    break;
-                default:
-                    record[name] = row[name].get<>();
-                }
+            else if (!lines)
+                buffer += ",\n";
 
-            }
+            plan.write(row, buffer);
+            if (lines)
+                buffer += '\n';
 
-            out << record;
+            if (buffer.size() >= JSON_BUFFER_SIZE) {
+                out.write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
         }
-        
-        out << "\n]";
+
+        if (!lines)
+            buffer += "\n]";
+        out.write(buffer.data(), buffer.size());
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,397 @@
+#pragma once
+#include <csv_parser.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace toolkit {
+    /** @file
+     *  Helpers for splitting a CSV file into record-aligned byte ranges
+     *  and processing them on multiple threads
+     */
+    namespace helpers {
+        /** Approximate size of the byte range handed to a worker thread */
+        const size_t PARALLEL_CHUNK_SIZE = 4 * 1024 * 1024;
+
+        /** Bytes read from disk at a time when scanning or reading ranges */
+        const size_t SCAN_BLOCK_SIZE = 1024 * 1024;
+
+        inline size_t leading_records(const csv::CSVFormat& format) {
+            /** Records before the first row of data: the header and any
+             *  before it, or none if the file has no header (header = -1)
+             */
+            return format.header >= 0 ? (size_t)format.header + 1 : 0;
+        }
+
+        /** Finds record boundaries in a CSV file without parsing it, by
+         *  tracking only line terminators (\n, \r or \r\n) and quote parity.
+         *  Terminators inside quoted fields do not end a record, so a quote
+         *  character inside an unquoted field throws the count off; if that
+         *  leaves the end of the file inside quotes, the scan fails.
+         */
+        class RecordScanner {
+        public:
+            RecordScanner(const std::string& filename, char quote_char = '"') :
+                infile(filename, std::ios::binary), quote_char(quote_char) {
+                if (!infile)
+                    throw std::runtime_error("Cannot open file " + filename);
+
+                infile.seekg(0, std::ios::end);
+                this->file_size = (size_t)infile.tellg();
+                infile.seekg(0);
+            }
+
+            size_t size() const { return this->file_size; }
+
+            /** Offset of the next unread byte */
+            size_t tell() const { return this->pos; }
+
+            void seek(size_t offset) {
+                /** Continue scanning from offset, which must be the start of
+                 *  a record, e.g. one previously returned by skip()
+                 */
+                this->pos = std::min(offset, this->file_size);
+                this->in_quotes = false;
+            }
+
+            size_t skip(size_t n_records) {
+                /** Advance past n record terminators
+                 *  @returns The offset of the record after them, or the
+                 *           file size if the file ended first
+                 */
+                while (n_records && this->pos < this->file_size) {
+                    this->fill();
+                    const char * data = this->block.data() + (this->pos - this->block_start);
+                    const size_t len = this->block_start + this->block.size() - this->pos;
+
+                    // Fast path: no quotes or carriage returns in this block,
+                    // so every newline ends a record
+                    if (!this->in_quotes && !memchr(data, this->quote_char, len) && !memchr(data, '\r', len)) {
+                        size_t newlines = (size_t)std::count(data, data + len, '\n');
+                        if (newlines < n_records) {
+                            n_records -= newlines;
+                            this->pos += len;
+                            continue;
+                        }
+                    }
+
+                    size_t i = 0;
+                    bool ends_with_cr = false;
+                    while (i < len && n_records) {
+                        const char ch = data[i++];
+                        if (ch == this->quote_char) {
+                            this->in_quotes = !this->in_quotes;
+                        }
+                        else if ((ch == '\n' || ch == '\r') && !this->in_quotes) {
+                            n_records--;
+                            if (ch == '\r' && i < len && data[i] == '\n') i++;
+                            ends_with_cr = (ch == '\r' && i == len);
+                        }
+                    }
+
+                    this->pos += i;
+
+                    // A \r\n split between two blocks is a single terminator
+                    if (ends_with_cr && this->pos < this->file_size) {
+                        this->fill();
+                        if (this->block[this->pos - this->block_start] == '\n')
+                            this->pos++;
+                    }
+                }
+
+                if (this->in_quotes && this->pos >= this->file_size)
+                    throw std::runtime_error("Unbalanced quotes while scanning for record boundaries");
+
+                return this->pos;
+            }
+
+            size_t next_boundary(size_t offset) {
+                /** Return the start of the first record beginning after offset
+                 *  (or at the current position, if that is further along)
+                 */
+                while (this->pos < offset && this->pos < this->file_size) {
+                    this->fill();
+                    const char * data = this->block.data() + (this->pos - this->block_start);
+                    const size_t len = std::min(
+                        this->block_start + this->block.size() - this->pos, offset - this->pos);
+
+                    if (std::count(data, data + len, this->quote_char) % 2)
+                        this->in_quotes = !this->in_quotes;
+                    this->pos += len;
+                }
+
+                return this->skip(1);
+            }
+
+        private:
+            void fill() {
+                /** Make sure the block buffer contains pos */
+                if (this->pos >= this->block_start &&
+                    this->pos < this->block_start + this->block.size())
+                    return;
+
+                this->block.resize(SCAN_BLOCK_SIZE);
+                this->infile.clear();
+                this->infile.seekg(this->pos);
+                this->infile.read(this->block.data(), SCAN_BLOCK_SIZE);
+                this->block.resize((size_t)this->infile.gcount());
+                this->block_start = this->pos;
+
+                if (this->block.empty())
+                    throw std::runtime_error("Unexpected end of file while scanning records");
+            }
+
+            std::ifstream infile;
+            char quote_char;
+            size_t file_size = 0;
+            std::vector<char> block;
+            size_t block_start = 0;
+            size_t pos = 0;
+            bool in_quotes = false;
+        };
+
+        /** Splits a CSV file, after its header, into consecutive record-aligned
+         *  byte ranges of about chunk_size bytes each
+         */
+        class RecordRanges {
+        public:
+            using Range = std::pair<size_t, size_t>;
+
+            RecordRanges(const std::string& filename, csv::CSVFormat format,
+                size_t chunk_size = PARALLEL_CHUNK_SIZE) :
+                scanner(filename, format.quote_char), format(format), chunk_size(chunk_size) {
+                this->begin = this->scanner.skip(leading_records(format));
+                this->format.header = -1;
+            }
+
+            bool operator()(Range& range) {
+                /** Fill in the next range, or return false at the end of the file */
+                if (this->begin >= this->scanner.size()) return false;
+                size_t end = this->scanner.next_boundary(this->begin + this->chunk_size);
+                range = { this->begin, end };
+                this->begin = end;
+                return true;
+            }
+
+            /** Offset the next range starts at */
+            size_t tell() const { return this->begin; }
+
+            void seek(size_t offset) {
+                /** Start the next range at offset, a record boundary past the
+                 *  header, e.g. the end of a range handed out earlier
+                 */
+                if (offset > this->begin) {
+                    this->begin = offset;
+                    this->scanner.seek(offset);
+                }
+            }
+
+            /** Format for parsing a range with read_range(): no header, but
+             *  the file's column names
+             */
+            const csv::CSVFormat& get_format() const { return this->format; }
+
+        private:
+            RecordScanner scanner;
+            csv::CSVFormat format;
+            size_t chunk_size;
+            size_t begin = 0;
+        };
+
+        /** Parses the records in the byte range [begin, end) of a file,
+         *  reading from disk as rows are requested
+         */
+        class RangeReader {
+        public:
+            /** @param[in] format Should have header = -1 and col_names set,
+             *                    since the range does not start with a header
+             */
+            RangeReader(const std::string& filename, size_t begin, size_t end,
+                const csv::CSVFormat& format) :
+                infile(filename, std::ios::binary), reader(format),
+                buffer(SCAN_BLOCK_SIZE, '\0'), pos(begin), end(end) {
+                if (!this->infile)
+                    throw std::runtime_error("Cannot open file " + filename);
+                this->infile.seekg(begin);
+            }
+
+            bool read_row(csv::CSVRow& row) {
+                while (!this->reader.read_row(row)) {
+                    if (this->finished)
+                        return false;
+                    this->feed();
+                }
+
+                return true;
+            }
+
+        private:
+            void feed() {
+                size_t n = 0;
+                if (this->pos < this->end) {
+                    this->infile.read(&this->buffer[0], std::min(SCAN_BLOCK_SIZE, this->end - this->pos));
+                    n = (size_t)this->infile.gcount();
+                }
+
+                if (!n) {
+                    this->reader.end_feed();
+                    this->finished = true;
+                    return;
+                }
+
+                this->reader.feed(csv::string_view(this->buffer.data(), n));
+                this->pos += n;
+            }
+
+            std::ifstream infile;
+            csv::CSVReader reader;
+            std::string buffer;
+            size_t pos;
+            size_t end;
+            bool finished = false;
+        };
+
+        template<typename Function>
+        void read_range(const std::string& filename, size_t begin, size_t end,
+            const csv::CSVFormat& format, Function on_row) {
+            /** Parse the records in the byte range [begin, end) of a file
+             *  and call on_row() with each one
+             *
+             *  @param[in] format Should have header = -1 and col_names set,
+             *                    since the range does not start with a header
+             */
+            RangeReader reader(filename, begin, end, format);
+            csv::CSVRow row;
+            while (reader.read_row(row))
+                on_row(row);
+        }
+
+        template<typename Task, typename Result,
+            typename NextTask, typename Produce, typename Consume>
+        void parallel_ordered(size_t n_threads, size_t max_in_flight,
+            NextTask next_task, Produce produce, Consume consume) {
+            /** Run produce() on n_threads worker threads and hand the results
+             *  to consume() on the calling thread, in the order the tasks were
+             *  handed out
+             *
+             *  @param[in] next_task  bool(Task&): Fill in the next task, or return
+             *                        false if there are none left. Calls are
+             *                        serialized.
+             *  @param[in] produce    Result(Task&): Called concurrently
+             *  @param[in] consume    void(Result&): Called in task order
+             *  @param[in] max_in_flight Maximum number of tasks that may be claimed
+             *                        but not yet consumed, so a slow consumer
+             *                        applies backpressure instead of letting
+             *                        results pile up in memory
+             *
+             *  The first exception thrown by any callback stops the pipeline
+             *  and is rethrown here.
+             */
+            std::mutex lock;
+            std::condition_variable cond;
+            std::map<size_t, Result> finished;
+            std::exception_ptr error;
+            size_t claimed = 0, consumed = 0;
+            bool exhausted = false;
+            max_in_flight = std::max(max_in_flight, (size_t)1);
+
+            auto fail = [&](std::exception_ptr err) {
+                std::lock_guard<std::mutex> guard(lock);
+                if (!error) error = err;
+                cond.notify_all();
+            };
+
+            auto worker = [&]() {
+                while (true) {
+                    Task task;
+                    size_t index;
+
+                    {
+                        std::unique_lock<std::mutex> guard(lock);
+                        cond.wait(guard, [&]() {
+                            return error || exhausted || claimed < consumed + max_in_flight;
+                        });
+
+                        if (error || exhausted) return;
+
+                        try {
+                            if (!next_task(task)) {
+                                exhausted = true;
+                                cond.notify_all();
+                                return;
+                            }
+                        }
+                        catch (...) {
+                            if (!error) error = std::current_exception();
+                            cond.notify_all();
+                            return;
+                        }
+
+                        index = claimed++;
+                    }
+
+                    try {
+                        Result result = produce(task);
+                        std::lock_guard<std::mutex> guard(lock);
+                        finished.emplace(index, std::move(result));
+                        cond.notify_all();
+                    }
+                    catch (...) {
+                        fail(std::current_exception());
+                        return;
+                    }
+                }
+            };
+
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i < std::max(n_threads, (size_t)1); i++)
+                workers.push_back(std::thread(worker));
+
+            while (true) {
+                Result result;
+
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    cond.wait(guard, [&]() {
+                        return error || finished.count(consumed) ||
+                            (exhausted && consumed == claimed);
+                    });
+
+                    auto it = finished.find(consumed);
+                    if (error || it == finished.end()) break;
+
+                    result = std::move(it->second);
+                    finished.erase(it);
+                }
+
+                try {
+                    consume(result);
+                }
+                catch (...) {
+                    fail(std::current_exception());
+                    break;
+                }
+
+                std::lock_guard<std::mutex> guard(lock);
+                consumed++;
+                cond.notify_all();
+            }
+
+            for (auto& thread: workers)
+                thread.join();
+
+            if (error)
+                std::rethrow_exception(error);
+        }
+    }
+}
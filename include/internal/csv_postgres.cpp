@@ -2,6 +2,7 @@
 #include <iostream>
 #include <fstream>
 #include "csv_postgres.hpp"
+#include "pg_connection.hpp"
 
 int main(int argc, char** argv) {
     using namespace toolkit;
@@ -10,9 +11,24 @@ int main(int argc, char** argv) {
     options.positional_help("[in] [out]");
     options.add_options("required")
         ("input", "input file", cxxopts::value<std::string>())
-        ("output", "output file", cxxopts::value<std::string>());
+        ("output", "output file (not needed with --connect)", cxxopts::value<std::string>());
     options.add_options("optional")
-        ("n,skiplines", "Skip the first n lines", cxxopts::value<size_t>()->default_value("0"));
+        ("n,skiplines", "Skip the first n lines", cxxopts::value<size_t>()->default_value("0"))
+        ("b,binary", "Write rows in COPY's binary format, to a separate data file "
+            "unless loading with --connect")
+        ("data-file", "With --binary, where to write rows (default: [out].bin)",
+            cxxopts::value<std::string>()->default_value(""))
+        ("nrows", "Infer types from the first n rows and read the file only once, "
+            "widening columns afterwards if needed (0: scan the whole file first)",
+            cxxopts::value<size_t>()->default_value("0"))
+        ("c,connect", "Load straight into a Postgres server, given a libpq connection "
+            "string, instead of writing a dump file",
+            cxxopts::value<std::string>()->default_value(""))
+        ("unlogged", "Create an UNLOGGED table")
+        ("shards", "Split the rows into n COPY scripts, [out].0.sql and so on, which "
+            "can be loaded in parallel after [out]", cxxopts::value<size_t>()->default_value("1"))
+        ("shard-by", "Assign rows to shards by a hash of this column (default: in turn)",
+            cxxopts::value<std::string>()->default_value(""));
     options.parse_positional({ "input", "output" });
 
     if (argc < 3) {
@@ -23,14 +39,56 @@ int main(int argc, char** argv) {
     try {
         auto results = options.parse(argc, argv);
 
-        PGOptions pg_options;
+        PGOptions pg_options = DEFAULT_PG;
         pg_options.skiplines = results["skiplines"].as<size_t>();
+        pg_options.sample_rows = results["nrows"].as<size_t>();
 
-        std::ofstream out(argv[2]);
-        toolkit::csv_to_postgres(argv[1], out, pg_options);
+        auto input = results["input"].as<std::string>();
+        auto conninfo = results["connect"].as<std::string>();
+        auto output = results.count("output") ? results["output"].as<std::string>() : "";
+
+        if (results["binary"].as<bool>()) {
+            pg_options.format = PGFormat::BINARY;
+            pg_options.data_file = results["data-file"].as<std::string>();
+            if (pg_options.data_file.empty() && !output.empty())
+                pg_options.data_file = output + ".bin";
+        }
+
+        if (!conninfo.empty() && !results["data-file"].as<std::string>().empty())
+            throw std::runtime_error("--data-file can't be used with --connect, which streams rows");
+
+        pg_options.unlogged = results["unlogged"].as<bool>();
+        pg_options.shards = results["shards"].as<size_t>();
+        pg_options.shard_column = results["shard-by"].as<std::string>();
+        if (!pg_options.shard_column.empty())
+            pg_options.sharding = PGSharding::HASH;
+
+        pg_options.shard_prefix = output;
+        if (output.size() > 4 && output.compare(output.size() - 4, 4, ".sql") == 0)
+            pg_options.shard_prefix = output.substr(0, output.size() - 4);
+
+        if (!conninfo.empty()) {
+            if (pg_options.shards > 1)
+                throw std::runtime_error("--shards can't be used with --connect");
+
+#ifdef TOOLKIT_LIBPQ
+            PGSession session(conninfo);
+            toolkit::load_postgres(input, session, pg_options);
+#else
+            throw std::runtime_error("--connect is unavailable: csvpg was built without libpq");
+#endif
+        }
+        else {
+            if (output.empty())
+                throw std::runtime_error("No output file given");
+
+            std::ofstream out(output);
+            toolkit::csv_to_postgres(input, out, pg_options);
+        }
     }
-    catch (std::runtime_error& err) {
-        std::cout << "Error: " << err.what() << std::endl;
+    catch (std::exception& err) {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return 1;
     }
 
     return 0;
@@ -1,79 +1,708 @@
+#pragma once
 #include <csv_parser.hpp>
+#include "csv_parallel.hpp"
+#include "string_scan.hpp"
+#include "temp_file.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <sstream>
+#include <vector>
 
 namespace toolkit {
+    enum class PGFormat {
+        TEXT,  /**< COPY's default tab-separated text format, inline in the dump */
+        BINARY /**< COPY's binary format, in a separate data file */
+    };
+
+    enum class PGSharding {
+        ROUND_ROBIN, /**< Rows are dealt out to each shard in turn */
+        HASH         /**< Rows are assigned by a hash of the shard column */
+    };
+
     struct PGOptions {
         std::string table_name;
-        size_t skiplines;
+        size_t skiplines;         /**< Rows after the header to skip over without parsing */
+        PGFormat format;
+        std::string data_file;    /**< PGFormat::BINARY: Where to write the rows */
+        size_t sample_rows;       /**< Infer column types from this many rows and read the
+                                   *   file only once (0: scan the whole file beforehand) */
+        bool unlogged;            /**< Create an UNLOGGED table */
+        size_t shards;            /**< Split the rows into this many COPY scripts */
+        PGSharding sharding;
+        std::string shard_column; /**< PGSharding::HASH: Column to hash (default: the first) */
+        std::string shard_prefix; /**< Shards are written to [prefix].[n].sql, and with
+                                   *   PGFormat::BINARY, [prefix].[n].bin */
     };
 
     const PGOptions DEFAULT_PG = {
         "",
-        0
+        0,
+        PGFormat::TEXT,
+        "",
+        0,
+        false,
+        1,
+        PGSharding::ROUND_ROBIN,
+        "",
+        ""
     };
 
-    template<typename OutputStream>
-    void csv_to_postgres(const std::string& in, OutputStream& out, const PGOptions& opts = DEFAULT_PG) {
-        // Convert a CSV file to a Postgres dump file
-        csv::CSVReader reader(in);
-        csv::StatOptions stat_options = { opts.skiplines };
-        auto dtypes = csv::csv_data_types(in, stat_options);
-        size_t skiplines = opts.skiplines;
+    namespace helpers {
+        /** Column types, from narrowest to widest */
+        enum class PGType { BIGINT, DOUBLE, TEXT };
 
-        std::string table_name = opts.table_name;
-        if (table_name.empty())
-            table_name = in;
-
-        // Generate CREATE TABLE statement
-        out << "CREATE TABLE IF NOT EXISTS \"" << table_name << "\" (" << std::endl;
-
-        size_t i = 0;
-        for (auto& name: reader.get_col_names()) {
-            auto& type = dtypes[name];
-            std::string type_name;
-
-            switch (type) {
+        inline PGType pg_type(csv::DataType dtype) {
+            switch (dtype) {
             case csv::CSV_DOUBLE:
-                type_name = "double precision";
-                break;
+                return PGType::DOUBLE;
             case csv::CSV_LONG_LONG_INT:
             case csv::CSV_LONG_INT:
             case csv::CSV_INT:
-                type_name = "bigint";
-                break;
+                return PGType::BIGINT;
             default:
-                type_name = "text";
+                return PGType::TEXT;
             }
+        }
+
+        inline bool pg_fits(PGType type, csv::DataType dtype) {
+            /** Whether a value of type dtype can be loaded into a column of type */
+            return dtype == csv::CSV_NULL || pg_type(dtype) <= type;
+        }
 
-            out << "\t\"" << name << "\" " << type_name;
+        inline const char * pg_type_name(PGType type) {
+            switch (type) {
+            case PGType::DOUBLE: return "double precision";
+            case PGType::BIGINT: return "bigint";
+            default: return "text";
+            }
+        }
 
-            if (i + 1 < dtypes.size()) out << ",";
-            out << std::endl;
+        inline std::string pg_quote_literal(const std::string& str) {
+            /** Quote a string as a SQL literal, doubling any single quotes */
+            std::string quoted = "'";
+            for (char ch: str) {
+                if (ch == '\'') quoted += '\'';
+                quoted += ch;
+            }
 
-            i++;
+            return quoted + "'";
         }
 
-        out << ");" << std::endl;
+        /** Writes rows in COPY's binary format: a signature and header,
+         *  then per row a field count followed by length-prefixed fields
+         *  (length -1 for NULL), then a trailer. Integers are big-endian.
+         */
+        class PGBinaryWriter {
+        public:
+            PGBinaryWriter(const std::vector<PGType>& types) : types(types) {}
+
+            void header(std::string& out) const {
+                static const char signature[11] = { 'P', 'G', 'C', 'O', 'P', 'Y', '\n', '\377', '\r', '\n', '\0' };
+                out.append(signature, sizeof(signature));
+                put_int32(out, 0); // Flags
+                put_int32(out, 0); // Header extension length
+            }
+
+            void write_row(csv::CSVRow& row, std::string& out) const {
+                /** Append a tuple. Short rows are padded with NULLs, and
+                 *  fields past the last column are dropped.
+                 */
+                using namespace csv;
+                put_int16(out, (int16_t)this->types.size());
+
+                for (size_t i = 0; i < this->types.size(); i++) {
+                    if (i >= row.size()) {
+                        put_int32(out, -1);
+                        continue;
+                    }
 
-        // Generate COPY statement
-        out << "COPY \"" << table_name << "\" FROM stdin;" << std::endl;
+                    CSVField field = row[i];
+                    DataType dtype = field.type();
 
-        // Copy CSV data
-        // TODO: What to do with embedded "\t" in fields?
-        for (auto& row : reader) {
-            if (skiplines) {
-                skiplines--;
+                    if (dtype == CSV_NULL) {
+                        put_int32(out, -1);
+                        continue;
+                    }
+
+                    switch (this->types[i]) {
+                    case PGType::BIGINT:
+                        if (dtype == CSV_STRING || dtype == CSV_DOUBLE)
+                            throw std::runtime_error("Not a bigint: " + field.get<>());
+                        put_int32(out, 8);
+                        put_int64(out, (int64_t)field.get<long long int>());
+                        break;
+                    case PGType::DOUBLE: {
+                        if (dtype == CSV_STRING)
+                            throw std::runtime_error("Not a number: " + field.get<>());
+                        double value = field.get<double>();
+                        uint64_t bits;
+                        memcpy(&bits, &value, sizeof(bits));
+                        put_int32(out, 8);
+                        put_int64(out, (int64_t)bits);
+                        break;
+                    }
+                    default: {
+                        auto text = field.get<csv::string_view>();
+                        put_int32(out, (int32_t)text.size());
+                        out.append(text.data(), text.size());
+                    }
+                    }
+                }
             }
-            else {
-                for (size_t j = 0; j < row.size(); j++) {
-                    out << row[j].get<>();
-                    if (j + 1 < row.size()) out << "\t";
-                    else out << "\n";
+
+            void trailer(std::string& out) const {
+                put_int16(out, -1);
+            }
+
+        private:
+            static void put_int16(std::string& out, int16_t value) {
+                uint16_t bits = (uint16_t)value;
+                out += (char)(bits >> 8);
+                out += (char)bits;
+            }
+
+            static void put_int32(std::string& out, int32_t value) {
+                uint32_t bits = (uint32_t)value;
+                for (int shift = 24; shift >= 0; shift -= 8)
+                    out += (char)(bits >> shift);
+            }
+
+            static void put_int64(std::string& out, int64_t value) {
+                uint64_t bits = (uint64_t)value;
+                for (int shift = 56; shift >= 0; shift -= 8)
+                    out += (char)(bits >> shift);
+            }
+
+            std::vector<PGType> types;
+        };
+
+        inline void copy_escape(std::string& out, csv::string_view str) {
+            /** Append str to out as a field of COPY's text format. Bytes are
+             *  copied in bulk up to the next one which needs a backslash escape.
+             */
+            while (!str.empty()) {
+                size_t safe = copy_safe_prefix(str.data(), str.size());
+                out.append(str.data(), safe);
+                if (safe == str.size())
+                    break;
+
+                switch (str[safe]) {
+                case '\t': out += "\\t"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                default: out += "\\\\";
                 }
+
+                str.remove_prefix(safe + 1);
             }
         }
 
-        out << "\\." << std::endl;
+        /** Writes rows in COPY's text format: tab-separated fields with
+         *  backslash escapes and \N for NULL
+         */
+        class PGTextWriter {
+        public:
+            PGTextWriter(size_t n_cols) : n_cols(n_cols) {}
+
+            void header(std::string&) const {}
+
+            void write_row(csv::CSVRow& row, std::string& out) const {
+                /** Append a line. Short rows are padded with NULLs, and
+                 *  fields past the last column are dropped.
+                 */
+                for (size_t i = 0; i < this->n_cols; i++) {
+                    if (i) out += '\t';
+
+                    if (i >= row.size()) {
+                        out += "\\N";
+                        continue;
+                    }
+
+                    csv::CSVField field = row[i];
+                    auto text = field.get<csv::string_view>();
+
+                    // Only a field starting with a space can be blank but non-empty
+                    if (text.empty() || (text.front() == ' ' && field.type() == csv::CSV_NULL))
+                        out += "\\N";
+                    else
+                        copy_escape(out, text);
+                }
+
+                out += '\n';
+            }
+
+            void trailer(std::string&) const {}
+
+        private:
+            size_t n_cols;
+        };
+
+        /** The rows of a CSV file after its header and the next skiplines
+         *  rows. Without skiplines, it is read start to finish by a
+         *  CSVReader. Otherwise, the skipped rows are passed over without
+         *  being parsed, by looking for record boundaries (see RecordScanner),
+         *  and the rest is read by a RangeReader.
+         */
+        class DataReader {
+        public:
+            DataReader(const std::string& filename, size_t skiplines) :
+                reader(new csv::CSVReader(filename)) {
+                this->col_names = this->reader->get_col_names();
+                if (!skiplines)
+                    return;
+
+                csv::CSVFormat format = this->reader->get_format();
+                RecordScanner scanner(filename, format.quote_char);
+                const size_t start = scanner.skip(leading_records(format) + skiplines);
+                format.header = -1;
+                format.col_names = this->col_names;
+
+                this->range.reset(new RangeReader(filename, start, scanner.size(), format));
+                this->reader.reset();
+            }
+
+            const std::vector<std::string>& get_col_names() const { return this->col_names; }
+
+            bool read_row(csv::CSVRow& row) {
+                return this->range ? this->range->read_row(row) : this->reader->read_row(row);
+            }
+
+        private:
+            std::unique_ptr<csv::CSVReader> reader;
+            std::unique_ptr<RangeReader> range;
+            std::vector<std::string> col_names;
+        };
+
+        /** Writes the output of csv_to_postgres as a dump: SQL statements,
+         *  followed by COPY data inline, or for COPY data with a file name,
+         *  psql's \copy once that file has been written.
+         *
+         *  Every Session (see load_postgres()) has the same methods.
+         */
+        template<typename OutputStream>
+        class PGScriptSink {
+        public:
+            PGScriptSink(OutputStream& out) : out(out) {}
+
+            void exec(const std::string& sql) {
+                this->out << sql << std::endl;
+            }
+
+            void copy_begin(const std::string& table_name, PGFormat format, const std::string& data_file) {
+                this->table_name = table_name;
+                this->format = format;
+                this->data_file = data_file;
+
+                if (data_file.empty()) {
+                    this->out << "COPY \"" << table_name << "\" FROM stdin;" << std::endl;
+                    return;
+                }
+
+                this->data.open(data_file, std::ios::binary);
+                if (!this->data)
+                    throw std::runtime_error("Cannot open " + data_file);
+            }
+
+            void copy_data(const char * data, size_t len) {
+                if (this->data_file.empty())
+                    this->out.write(data, len);
+                else
+                    this->data.write(data, len);
+            }
+
+            void copy_end() {
+                if (this->data_file.empty()) {
+                    this->out << "\\." << std::endl;
+                    return;
+                }
+
+                this->data.close();
+                if (!this->data)
+                    throw std::runtime_error("Could not write to " + this->data_file);
+
+                // Only refer to the data file once it's complete, in case the
+                // dump is being loaded as it's written
+                this->out << "\\copy \"" << this->table_name << "\" FROM " << pg_quote_literal(this->data_file)
+                    << (this->format == PGFormat::BINARY ? " WITH (FORMAT binary)" : "") << std::endl;
+            }
+
+        private:
+            OutputStream& out;
+            std::string table_name;
+            PGFormat format = PGFormat::TEXT;
+            std::string data_file;
+            std::ofstream data;
+        };
+
+        /** Bytes of COPY data buffered before being sent on */
+        const size_t PG_BUFFER_SIZE = 64 * 1024;
+
+        /** Buffers COPY data from a Writer and sends it to a Session in large pieces */
+        template<typename Writer, typename Session>
+        class CopyStream {
+        public:
+            CopyStream(const Writer& writer, Session& session) : writer(writer), session(session) {
+                this->buffer.reserve(PG_BUFFER_SIZE * 2);
+                this->writer.header(this->buffer);
+            }
+
+            void write_row(csv::CSVRow& row) {
+                this->writer.write_row(row, this->buffer);
+                if (this->buffer.size() >= PG_BUFFER_SIZE)
+                    this->flush();
+            }
+
+            void finish() {
+                this->writer.trailer(this->buffer);
+                this->flush();
+            }
+
+        private:
+            void flush() {
+                this->session.copy_data(this->buffer.data(), this->buffer.size());
+                this->buffer.clear();
+            }
+
+            const Writer writer;
+            Session& session;
+            std::string buffer;
+        };
+
+        /** COPY data held in a temporary file until it can be sent */
+        class DeferredRows {
+        public:
+            void copy_data(const char * data, size_t len) {
+                this->file.write(data, len);
+            }
+
+            template<typename Session>
+            void send_to(Session& session) {
+                this->file.rewind();
+                std::vector<char> chunk(PG_BUFFER_SIZE);
+                size_t n;
+                while ((n = this->file.read(chunk.data(), chunk.size())) > 0)
+                    session.copy_data(chunk.data(), n);
+            }
+
+        private:
+            TempFile file;
+        };
+
+        template<typename Writer, typename Session>
+        void copy_rows(DataReader& reader, const Writer& writer, Session& session) {
+            /** Send every row of reader as COPY data */
+            CopyStream<Writer, Session> stream(writer, session);
+            csv::CSVRow row;
+
+            while (reader.read_row(row))
+                stream.write_row(row);
+
+            stream.finish();
+        }
+
+        inline uint64_t fnv1a(csv::string_view str) {
+            /** A hash which is the same on every platform and run */
+            uint64_t hash = 14695981039346656037ULL;
+            for (char ch: str) {
+                hash ^= (unsigned char)ch;
+                hash *= 1099511628211ULL;
+            }
+
+            return hash;
+        }
+
+        template<typename Writer>
+        void copy_shards(DataReader& reader, const Writer& writer, const std::string& table_name,
+            PGFormat format, const std::vector<std::string>& scripts,
+            const std::vector<std::string>& data_files, size_t key_col) {
+            /** Split the rows of reader between several COPY scripts, which
+             *  hold the rows inline in text format, or load them from
+             *  data_files in binary format
+             *
+             *  @param[in] key_col Assign rows by a hash of this column, or deal
+             *                     them out in turn if it is npos
+             */
+            using Sink = PGScriptSink<std::ofstream>;
+            std::vector<std::unique_ptr<std::ofstream>> files;
+            std::vector<std::unique_ptr<Sink>> sinks;
+            std::vector<std::unique_ptr<CopyStream<Writer, Sink>>> streams;
+
+            for (size_t i = 0; i < scripts.size(); i++) {
+                files.emplace_back(new std::ofstream(scripts[i], std::ios::binary));
+                if (!*files.back())
+                    throw std::runtime_error("Cannot open " + scripts[i]);
+
+                sinks.emplace_back(new Sink(*files.back()));
+                sinks.back()->copy_begin(table_name, format, format == PGFormat::BINARY ? data_files[i] : "");
+                streams.emplace_back(new CopyStream<Writer, Sink>(writer, *sinks.back()));
+            }
+
+            size_t next = 0;
+            csv::CSVRow row;
+            while (reader.read_row(row)) {
+                size_t shard;
+                if (key_col == std::string::npos)
+                    shard = next++ % streams.size();
+                else if (key_col < row.size())
+                    shard = (size_t)(fnv1a(row[key_col].get<csv::string_view>()) % streams.size());
+                else
+                    shard = (size_t)(fnv1a("") % streams.size());
+
+                streams[shard]->write_row(row);
+            }
+
+            for (size_t i = 0; i < streams.size(); i++) {
+                streams[i]->finish();
+                sinks[i]->copy_end();
+                files[i]->close();
+                if (!*files[i])
+                    throw std::runtime_error("Could not write to " + scripts[i]);
+            }
+        }
+
+        template<typename Writer, typename Session>
+        std::vector<PGType> copy_rows_widening(DataReader& reader, std::deque<csv::CSVRow>& sample,
+            const std::vector<PGType>& types, const Writer& writer, Session& session, DeferredRows& deferred) {
+            /** Send the sampled rows, then the rest of reader, as COPY data.
+             *  Rows with a value that doesn't fit its column's type are written
+             *  to deferred in text format instead, to be loaded once the table
+             *  has been altered.
+             *
+             *  @returns The widest type seen in each column
+             */
+            CopyStream<Writer, Session> stream(writer, session);
+            CopyStream<PGTextWriter, DeferredRows> deferred_stream(PGTextWriter(types.size()), deferred);
+            std::vector<PGType> widened = types;
+
+            auto write_row = [&](csv::CSVRow& row) {
+                bool fits = true;
+                for (size_t i = 0; i < std::min(row.size(), types.size()); i++) {
+                    auto dtype = row[i].type();
+                    if (!pg_fits(types[i], dtype)) {
+                        fits = false;
+                        widened[i] = std::max(widened[i], pg_type(dtype));
+                    }
+                }
+
+                if (fits)
+                    stream.write_row(row);
+                else
+                    deferred_stream.write_row(row);
+            };
+
+            for (auto& row : sample)
+                write_row(row);
+            sample.clear();
+
+            csv::CSVRow row;
+            while (reader.read_row(row))
+                write_row(row);
+
+            stream.finish();
+            deferred_stream.finish();
+            return widened;
+        }
+
+        inline std::vector<PGType> infer_types(DataReader& reader, size_t n_cols,
+            size_t max_rows, std::deque<csv::CSVRow>& sample) {
+            /** Find the narrowest type which fits every value in each column,
+             *  from at most max_rows rows (0: every row). The rows read are
+             *  kept in sample if max_rows is set. Columns which are always
+             *  empty are text.
+             */
+            std::vector<PGType> types(n_cols, PGType::TEXT);
+            std::vector<bool> seen(n_cols, false);
+            csv::CSVRow row;
+            size_t n_rows = 0;
+
+            while ((!max_rows || n_rows < max_rows) && reader.read_row(row)) {
+                for (size_t i = 0; i < std::min(row.size(), n_cols); i++) {
+                    auto dtype = row[i].type();
+                    if (dtype == csv::CSV_NULL) continue;
+
+                    auto type = pg_type(dtype);
+                    types[i] = seen[i] ? std::max(types[i], type) : type;
+                    seen[i] = true;
+                }
+
+                n_rows++;
+                if (max_rows)
+                    sample.push_back(row);
+            }
+
+            return types;
+        }
+
+        inline size_t shard_key(const std::vector<std::string>& col_names, const PGOptions& opts) {
+            /** Check the sharding options before anything is written, and
+             *  return the index of the column rows are hashed on
+             *  (std::string::npos for round robin sharding)
+             */
+            if (opts.sample_rows)
+                throw std::runtime_error("Sharded output needs column types from a full scan");
+            if (opts.shard_prefix.empty())
+                throw std::runtime_error("Sharded output needs a file name prefix");
+            if (opts.sharding != PGSharding::HASH)
+                return std::string::npos;
+            if (opts.shard_column.empty())
+                return 0;
+
+            auto it = std::find(col_names.begin(), col_names.end(), opts.shard_column);
+            if (it == col_names.end())
+                throw std::runtime_error("Can't find a column named " + opts.shard_column);
+            return (size_t)(it - col_names.begin());
+        }
+
+        inline void write_shards(DataReader& reader, const std::string& table_name,
+            const std::vector<PGType>& types, size_t key_col, const PGOptions& opts) {
+            /** Split the rows between opts.shards COPY scripts, which can be
+             *  loaded concurrently once the table has been created
+             */
+            std::vector<std::string> scripts, data_files;
+            for (size_t i = 0; i < opts.shards; i++) {
+                const std::string prefix = opts.shard_prefix + "." + std::to_string(i);
+                scripts.push_back(prefix + ".sql");
+                data_files.push_back(prefix + ".bin");
+            }
+
+            if (opts.format == PGFormat::TEXT)
+                copy_shards(reader, PGTextWriter(types.size()), table_name, opts.format, scripts, data_files, key_col);
+            else
+                copy_shards(reader, PGBinaryWriter(types), table_name, opts.format, scripts, data_files, key_col);
+        }
+    }
+
+    template<typename Session>
+    void load_postgres(const std::string& in, Session& session, const PGOptions& opts = DEFAULT_PG) {
+        /** Create a Postgres table for a CSV file and load its rows, by
+         *  sending statements and COPY data to session:
+         *
+         *   - exec(sql):                               Run a statement
+         *   - copy_begin(table_name, format, data_file): Start a COPY FROM STDIN
+         *   - copy_data(data, len):                    Send COPY data
+         *   - copy_end():                              Finish the COPY
+         *
+         *  data_file is where a dump should put the rows instead of inline
+         *  (empty: inline). A session with a server (see PGSession) streams
+         *  them either way. See csv_to_postgres() for the options.
+         */
+        using helpers::PGType;
+
+        std::string table_name = opts.table_name;
+        if (table_name.empty())
+            table_name = in;
+
+        helpers::DataReader reader(in, opts.skiplines);
+        const std::vector<std::string> col_names = reader.get_col_names();
+        const size_t key_col = opts.shards > 1 ? helpers::shard_key(col_names, opts) : std::string::npos;
+
+        // Infer column types
+        std::vector<PGType> types;
+        std::deque<csv::CSVRow> sample;
+
+        if (opts.sample_rows) {
+            types = helpers::infer_types(reader, col_names.size(), opts.sample_rows, sample);
+        }
+        else {
+            helpers::DataReader type_reader(in, opts.skiplines);
+            types = helpers::infer_types(type_reader, col_names.size(), 0, sample);
+        }
+
+        // Generate CREATE TABLE statement
+        std::string create = "CREATE " + std::string(opts.unlogged ? "UNLOGGED " : "") +
+            "TABLE IF NOT EXISTS \"" + table_name + "\" (\n";
+
+        for (size_t i = 0; i < col_names.size(); i++) {
+            create += "\t\"" + col_names[i] + "\" " + helpers::pg_type_name(types[i]);
+
+            if (i + 1 < col_names.size()) create += ",";
+            create += "\n";
+        }
+
+        session.exec(create + ");");
+
+        if (opts.shards > 1) {
+            helpers::write_shards(reader, table_name, types, key_col, opts);
+            return;
+        }
+
+        // Generate COPY statement and data
+        std::vector<PGType> widened = types;
+        helpers::DeferredRows deferred;
+        session.copy_begin(table_name, opts.format, opts.format == PGFormat::BINARY ? opts.data_file : "");
+
+        if (opts.format == PGFormat::BINARY) {
+            helpers::PGBinaryWriter writer(types);
+            if (opts.sample_rows)
+                widened = helpers::copy_rows_widening(reader, sample, types, writer, session, deferred);
+            else
+                helpers::copy_rows(reader, writer, session);
+        }
+        else {
+            helpers::PGTextWriter writer(types.size());
+            if (opts.sample_rows)
+                widened = helpers::copy_rows_widening(reader, sample, types, writer, session, deferred);
+            else
+                helpers::copy_rows(reader, writer, session);
+        }
+
+        session.copy_end();
+        if (widened == types)
+            return;
+
+        // Widen columns which had values that didn't fit, then load those rows
+        std::string alter = "ALTER TABLE \"" + table_name + "\"";
+        bool first = true;
+        for (size_t i = 0; i < col_names.size(); i++) {
+            if (widened[i] == types[i]) continue;
+
+            const std::string type_name = helpers::pg_type_name(widened[i]);
+            alter += std::string(first ? "" : ",") + "\n\tALTER COLUMN \"" + col_names[i] +
+                "\" TYPE " + type_name + " USING \"" + col_names[i] + "\"::" + type_name;
+            first = false;
+        }
+
+        session.exec(alter + ";");
+
+        session.copy_begin(table_name, PGFormat::TEXT,
+            opts.format == PGFormat::BINARY ? opts.data_file + ".deferred" : "");
+        deferred.send_to(session);
+        session.copy_end();
+    }
+
+    template<typename OutputStream>
+    void csv_to_postgres(const std::string& in, OutputStream& out, const PGOptions& opts = DEFAULT_PG) {
+        /** Convert a CSV file to a Postgres dump file
+         *
+         *  With PGFormat::BINARY, rows are written to opts.data_file as
+         *  int8, float8 and text fields in COPY's binary format, which needs
+         *  no escaping and is cheaper for the server to parse. The dump
+         *  then loads that file with psql's \copy.
+         *
+         *  Otherwise, rows are written inline in COPY's text format. Empty
+         *  fields are written as NULL.
+         *
+         *  If opts.sample_rows is set, column types are inferred from that
+         *  many rows, which are buffered and then written along with the
+         *  rest of the file, so it is only read once. Rows which turn out
+         *  not to fit those types are held back and loaded after an ALTER
+         *  TABLE widens the affected columns (bigint, then double precision,
+         *  then text).
+         *
+         *  If opts.shards > 1, the dump only creates the table, and the rows
+         *  are split between that many scripts (see PGOptions::shard_prefix)
+         *  which can be loaded by separate sessions in parallel.
+         */
+        if (opts.format == PGFormat::BINARY && opts.shards <= 1 && opts.data_file.empty())
+            throw std::runtime_error("Binary COPY output needs a data file");
+
+        helpers::PGScriptSink<OutputStream> sink(out);
+        load_postgres(in, sink, opts);
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,174 @@
+#pragma once
+#include "temp_file.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace toolkit {
+    /** @file
+     *  Sorting with bounded memory by spilling sorted runs to disk
+     */
+    namespace helpers {
+        using Row = std::vector<std::string>;
+        using RowCompare = std::function<bool(const Row&, const Row&)>;
+
+        inline size_t row_footprint(const Row& row) {
+            /** Rough number of bytes a row occupies in memory */
+            size_t bytes = sizeof(Row);
+            for (auto& field: row)
+                bytes += sizeof(std::string) + field.size();
+            return bytes;
+        }
+
+        /** A sorted run of rows in an anonymous temporary file, stored as
+         *  length-prefixed fields so it can be read back without parsing CSV
+         */
+        class SortedRun {
+        public:
+            void write(const Row& row) {
+                this->write_size(row.size());
+                for (auto& field: row) {
+                    this->write_size(field.size());
+                    this->file.write(field.data(), field.size());
+                }
+            }
+
+            void rewind() {
+                this->file.rewind();
+            }
+
+            bool read(Row& row) {
+                uint32_t n_fields;
+                if (!this->read_size(n_fields))
+                    return false;
+
+                row.resize(n_fields);
+                for (auto& field: row) {
+                    uint32_t len;
+                    if (!this->read_size(len))
+                        throw std::runtime_error("Temporary file is truncated");
+                    field.resize(len);
+                    if (len && this->file.read(&field[0], len) != len)
+                        throw std::runtime_error("Temporary file is truncated");
+                }
+
+                return true;
+            }
+
+        private:
+            void write_size(size_t size) {
+                uint32_t value = (uint32_t)size;
+                this->file.write((const char *)&value, sizeof(value));
+            }
+
+            bool read_size(uint32_t& size) {
+                return this->file.read((char *)&size, sizeof(size)) == sizeof(size);
+            }
+
+            TempFile file;
+        };
+
+        /** Sorts rows using at most (roughly) memory_limit bytes. Rows are
+         *  buffered until the limit is reached, then sorted and spilled to
+         *  disk as a run. Once every row has been pushed, the runs are
+         *  k-way merged.
+         */
+        class ExternalSorter {
+        public:
+            ExternalSorter(RowCompare less, size_t memory_limit) :
+                less(less), memory_limit(memory_limit) {}
+            ExternalSorter(const ExternalSorter&) = delete;
+            ExternalSorter& operator=(const ExternalSorter&) = delete;
+
+            void push(Row row) {
+                this->buffered_bytes += row_footprint(row);
+                this->buffer.push_back(std::move(row));
+
+                if (this->memory_limit && this->buffered_bytes >= this->memory_limit)
+                    this->spill();
+            }
+
+            void sort() {
+                /** Finish pushing rows and prepare to read them back in order */
+                std::stable_sort(this->buffer.begin(), this->buffer.end(), this->less);
+
+                if (!this->runs.empty()) {
+                    if (!this->buffer.empty())
+                        this->spill();
+
+                    for (size_t i = 0; i < this->runs.size(); i++) {
+                        this->runs[i]->rewind();
+                        this->heads.emplace_back();
+                        if (this->runs[i]->read(this->heads[i]))
+                            this->queue.push(i);
+                    }
+                }
+            }
+
+            bool next(Row& row) {
+                /** Get the next row in sorted order, after sort() */
+                if (this->runs.empty()) {
+                    if (this->pos == this->buffer.size()) {
+                        Row().swap(row);
+                        return false;
+                    }
+
+                    row = std::move(this->buffer[this->pos++]);
+                    return true;
+                }
+
+                if (this->queue.empty())
+                    return false;
+
+                size_t i = this->queue.top();
+                this->queue.pop();
+                row.swap(this->heads[i]);
+
+                if (this->runs[i]->read(this->heads[i]))
+                    this->queue.push(i);
+
+                return true;
+            }
+
+            size_t n_runs() const { return this->runs.size(); }
+
+        private:
+            void spill() {
+                std::stable_sort(this->buffer.begin(), this->buffer.end(), this->less);
+                this->runs.emplace_back(new SortedRun());
+                for (auto& row: this->buffer)
+                    this->runs.back()->write(row);
+
+                std::vector<Row>().swap(this->buffer);
+                this->buffered_bytes = 0;
+            }
+
+            /** Orders run indices by their current head row, smallest first,
+             *  breaking ties by run number so the merge is stable
+             */
+            struct HeadCompare {
+                ExternalSorter* sorter;
+                bool operator()(size_t left, size_t right) const {
+                    auto& heads = sorter->heads;
+                    if (sorter->less(heads[right], heads[left])) return true;
+                    if (sorter->less(heads[left], heads[right])) return false;
+                    return left > right;
+                }
+            };
+
+            RowCompare less;
+            size_t memory_limit;
+            size_t buffered_bytes = 0;
+            size_t pos = 0;
+            std::vector<Row> buffer;
+            std::vector<std::unique_ptr<SortedRun>> runs;
+            std::vector<Row> heads;
+            std::priority_queue<size_t, std::vector<size_t>, HeadCompare> queue{ HeadCompare{ this } };
+        };
+    }
+}
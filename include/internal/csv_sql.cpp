@@ -1,4 +1,10 @@
 #include "toolkit.h"
+#include "csv_parallel.hpp"
+#include "csv_sort.hpp"
+#include "sql_convert.hpp"
+#include "csv_vtab.hpp"
+#include <cstring>
+#include <filesystem>
 
 using namespace csv;
 using std::vector;
@@ -82,83 +88,95 @@ namespace toolkit {
             return new_vec;
         }
 
-        vector<string> sqlite_types(std::string filename, int nrows) {
-            /** Return the preferred data type for the columns of a file
-            * @param[in] filename Path to CSV file
-            * @param[in] nrows    Number of rows to examine
-            */
-
-            CSVStat stat(filename);
-            vector<string> sqlite_types;
-            auto dtypes = stat.get_dtypes();
-
-            auto most_common_finder = [](
-                const std::pair<DataType, RowCount>& left,
-                const std::pair<DataType, RowCount>& right
-                ) { return left.second < right.second; };
-
-            // Loop over each column
-            for (auto& col: dtypes) {
-                // Aggregate integer types
-                col[CSV_INT] = col[CSV_LONG_INT] + col[CSV_LONG_LONG_INT];
-
-                DataType most_common_dtype = std::max_element(col.begin(), col.end(),
-                    most_common_finder)->first;
-
-                switch (most_common_dtype) {
-                case 0:
-                case CSV_STRING:
-                    sqlite_types.push_back("string");
-                    break;
-                case CSV_INT:
-                    sqlite_types.push_back("integer");
-                    break;
-                case CSV_DOUBLE:
-                    sqlite_types.push_back("float");
-                    break;
-                }
-            }
-
-            return sqlite_types;
-        }
-
         std::string create_table(std::string filename, std::string table) {
             /** Generate a CREATE TABLE statement */
+            return create_table(get_col_names(filename), sqlite_types(filename), table);
+        }
+
+        std::string create_table(const vector<string>& col_names,
+            const vector<string>& col_types, const std::string& table,
+            const vector<string>& primary_key) {
+            /** Generate a CREATE TABLE statement from already known
+             *  column names and SQLite types. If primary_key is given,
+             *  the table is clustered on it (WITHOUT ROWID).
+             */
             string sql_stmt = "CREATE TABLE " + table + " (";
-            vector<string> col_names = sql_sanitize(get_col_names(filename));
-            vector<string> col_types = sqlite_types(filename);
+            vector<string> sanitized = sql_sanitize(col_names);
 
-            for (size_t i = 0; i < col_names.size(); i++) {
-                sql_stmt += col_names[i] + " " + col_types[i];
-                if (i + 1 != col_names.size())
+            for (size_t i = 0; i < sanitized.size(); i++) {
+                sql_stmt += sanitized[i] + " " + col_types[i];
+                if (i + 1 != sanitized.size())
                     sql_stmt += ",";
             }
 
+            if (!primary_key.empty()) {
+                sql_stmt += ",PRIMARY KEY (";
+                for (size_t i = 0; i < primary_key.size(); i++) {
+                    sql_stmt += sql_sanitize(primary_key[i]);
+                    if (i + 1 != primary_key.size())
+                        sql_stmt += ",";
+                }
+
+                sql_stmt += ")) WITHOUT ROWID;";
+                return sql_stmt;
+            }
+
             sql_stmt += ");";
             return sql_stmt;
         }
 
+        std::string create_index(const std::string& table, const std::string& column) {
+            /** Generate a CREATE INDEX statement for one column */
+            const string name = sql_sanitize(column);
+            return "CREATE INDEX IF NOT EXISTS " + table + "_" + name + "_idx ON " + table + " (" + name + ");";
+        }
+
         std::string insert_values(std::string filename, std::string table) {
             /** Generate an INSERT VALUES statement with placeholders
              *  in accordance with the SQLite C API
              */
+            return insert_values(get_col_names(filename).size(), table);
+        }
 
-            vector<string> col_names = get_col_names(filename);
-            string sql_stmt = "INSERT INTO " + table + " VALUES (";
+        std::string insert_values(size_t n_cols, const std::string& table, size_t n_rows) {
+            /** Generate an INSERT VALUES statement with n_cols placeholders
+             *  for each of n_rows rows, i.e. VALUES (?,?),(?,?),...
+             *
+             *  SQLite numbers anonymous placeholders in order, just like
+             *  ?1,?2,... but explicitly numbered ones take quadratic time to
+             *  prepare, which is ruinous for a large batch of a wide table.
+             */
+            string sql_stmt = "INSERT INTO " + table + " VALUES ";
 
-            for (size_t i = 1; i <= col_names.size(); i++) {
-                sql_stmt += "?";
-                sql_stmt += std::to_string(i);
-                if (i + 1 <= col_names.size())
-                    sql_stmt += ",";
+            for (size_t row = 0; row < n_rows; row++) {
+                sql_stmt += "(";
+                for (size_t i = 1; i <= n_cols; i++) {
+                    sql_stmt += "?";
+                    if (i + 1 <= n_cols)
+                        sql_stmt += ",";
+                }
+
+                sql_stmt += (row + 1 < n_rows) ? ")," : ")";
             }
 
-            sql_stmt += ");";
+            sql_stmt += ";";
             return sql_stmt;
         }
+
+        std::string pragma(const std::string& name, const std::string& value) {
+            /** Generate a PRAGMA statement, rejecting values that aren't
+             *  a plain keyword or number
+             */
+            for (char ch: value) {
+                if (!isalnum(ch) && ch != '-')
+                    throw std::runtime_error("Invalid value for PRAGMA " + name + ": " + value);
+            }
+
+            return "PRAGMA " + name + " = " + value + ";";
+        }
     }
 
-    inline void _throw_on_error(int result, char * error_message = nullptr) {
+    inline void _throw_on_error(int result, const char * error_message = nullptr) {
         if (result != 0 && result != 101) {
             if (!error_message) {
                 throw std::runtime_error("[SQLite Error] Code " + std::to_string(result));
@@ -170,116 +188,989 @@ namespace toolkit {
         }
     }
 
-    void csv_to_sql(std::string csv_file, std::string db_name, std::string table) {
+    namespace sql {
+        Statement::Statement(SQLite::Conn& db, const std::string& query) : db(db.get_ptr()) {
+            // Prepare before asking for the error message
+            int result = sqlite3_prepare_v2(this->db, query.c_str(), -1, &(this->stmt), nullptr);
+            _throw_on_error(result, sqlite3_errmsg(this->db));
+        }
+
+        Statement::~Statement() {
+            sqlite3_finalize(this->stmt);
+        }
+
+        void Statement::bind(size_t i, const std::string& value) {
+            sqlite3_bind_text(this->stmt, (int)i + 1, value.c_str(), (int)value.size(), SQLITE_TRANSIENT);
+        }
+
+        void Statement::bind(size_t i, csv::string_view value, sqlite3_destructor_type lifetime) {
+            /** Bind text without an intermediate std::string. Pass SQLITE_STATIC
+             *  only if value's buffer outlives the next call to next().
+             */
+            sqlite3_bind_text(this->stmt, (int)i + 1, value.data(), (int)value.size(), lifetime);
+        }
+
+        void Statement::bind(size_t i, int value) {
+            sqlite3_bind_int(this->stmt, (int)i + 1, value);
+        }
+
+        void Statement::bind(size_t i, long long int value) {
+            sqlite3_bind_int64(this->stmt, (int)i + 1, (sqlite3_int64)value);
+        }
+
+        void Statement::bind(size_t i, double value) {
+            sqlite3_bind_double(this->stmt, (int)i + 1, value);
+        }
+
+        void Statement::bind(size_t i, std::nullptr_t) {
+            sqlite3_bind_null(this->stmt, (int)i + 1);
+        }
+
+        void Statement::next() {
+            /** Execute the statement with the current bindings and reset it */
+            int result = sqlite3_step(this->stmt);
+            sqlite3_reset(this->stmt);
+            _throw_on_error(result, sqlite3_errmsg(this->db));
+        }
+    }
+
+    namespace {
+        /** Records how far into the CSV file a load has committed, in a
+         *  bookkeeping table inside the target database, so that an
+         *  interrupted load can be resumed from there. The file's size and
+         *  modification time are recorded too, and a load is only resumed
+         *  from the same file.
+         */
+        class Checkpoint {
+        public:
+            /** The byte offset of loads which read the file row by row */
+            static constexpr size_t NO_OFFSET = std::string::npos;
+
+            Checkpoint(SQLite::Conn& db, const string& table, const string& csv_file) :
+                db(db), table(table), csv_file(csv_file) {
+                this->file_size = (long long int)std::filesystem::file_size(csv_file);
+                this->file_mtime = (long long int)std::filesystem::last_write_time(csv_file)
+                    .time_since_epoch().count();
+
+                db.exec("CREATE TABLE IF NOT EXISTS _csvsql_progress ("
+                    "table_name TEXT PRIMARY KEY, byte_offset INTEGER, row_count INTEGER, "
+                    "file_size INTEGER, file_mtime INTEGER);");
+                this->save_stmt.reset(new sql::Statement(db,
+                    "INSERT OR REPLACE INTO _csvsql_progress VALUES (?1, ?2, ?3, ?4, ?5);"));
+            }
+
+            bool load(size_t& byte_offset, size_t& row_count) {
+                /** Get the last committed position, if any */
+                sql::Statement query(this->db, "SELECT byte_offset, row_count, file_size, file_mtime "
+                    "FROM _csvsql_progress WHERE table_name = ?1;");
+                query.bind(0, this->table);
+
+                sqlite3_stmt * stmt = query.get_ptr();
+                if (sqlite3_step(stmt) != SQLITE_ROW)
+                    return false;
+
+                if (sqlite3_column_int64(stmt, 2) != this->file_size || sqlite3_column_int64(stmt, 3) != this->file_mtime)
+                    throw std::runtime_error(this->csv_file + " has changed since table " + this->table +
+                        " was loaded from it");
+
+                byte_offset = sqlite3_column_type(stmt, 0) == SQLITE_NULL ?
+                    NO_OFFSET : (size_t)sqlite3_column_int64(stmt, 0);
+                row_count = (size_t)sqlite3_column_int64(stmt, 1);
+                return true;
+            }
+
+            void save(size_t byte_offset, size_t row_count) {
+                /** Record that row_count rows have been loaded, which are every
+                 *  record before byte_offset (unless it is NO_OFFSET). Call this
+                 *  inside the transaction which inserts the last of them.
+                 */
+                this->save_stmt->bind(0, this->table);
+                if (byte_offset == NO_OFFSET)
+                    this->save_stmt->bind(1, nullptr);
+                else
+                    this->save_stmt->bind(1, (long long int)byte_offset);
+                this->save_stmt->bind(2, (long long int)row_count);
+                this->save_stmt->bind(3, this->file_size);
+                this->save_stmt->bind(4, this->file_mtime);
+                this->save_stmt->next();
+            }
+
+        private:
+            SQLite::Conn& db;
+            string table;
+            string csv_file;
+            long long int file_size;
+            long long int file_mtime;
+            std::unique_ptr<sql::Statement> save_stmt;
+        };
+
+        bool table_exists(SQLite::Conn& db, const string& table) {
+            sql::Statement query(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?1;");
+            query.bind(0, table);
+            return sqlite3_step(query.get_ptr()) == SQLITE_ROW;
+        }
+
+        vector<string> declared_types(SQLite::Conn& db, const string& table) {
+            /** The column types an existing table was created with */
+            sql::Statement query(db, "PRAGMA table_info(" + table + ");");
+            vector<string> types;
+
+            while (sqlite3_step(query.get_ptr()) == SQLITE_ROW) {
+                auto type = (const char *)sqlite3_column_text(query.get_ptr(), 2);
+                types.push_back(type ? type : "");
+            }
+
+            return types;
+        }
+
+        /** Inserts rows using single and multi-row INSERT statements,
+         *  committing every so often according to the loader options
+         *
+         *  Loads which read the file by byte range start with a byte_offset,
+         *  report the end of each range with reached(), and only commit
+         *  there: after every range with opts.commit_bytes, otherwise after
+         *  the first range past opts.commit_interval rows. Loads which read
+         *  it row by row commit every opts.commit_interval rows. With a
+         *  Checkpoint, each commit records how far the load has got in the
+         *  same transaction as the rows.
+         */
+        class BulkInserter {
+        public:
+            BulkInserter(SQLite::Conn& db, const string& table, size_t n_cols,
+                const SQLOptions& opts, Checkpoint * checkpoint = nullptr,
+                size_t byte_offset = Checkpoint::NO_OFFSET, size_t row_count = 0) :
+                db(db), n_cols(n_cols), commit_interval(opts.commit_interval), commit_bytes(opts.commit_bytes),
+                insert_stmt(db, sql::insert_values(n_cols, table)), checkpoint(checkpoint),
+                byte_offset(byte_offset), row_count(row_count) {
+                // Rows per multi-row INSERT, bounded by the host parameter limit
+                const size_t max_params = (size_t)sqlite3_limit(db.get_ptr(),
+                    SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+                this->batch_rows = std::max((size_t)1,
+                    std::min(opts.batch_rows, max_params / n_cols));
+
+                if (this->batch_rows > 1)
+                    this->batch_stmt.reset(new sql::Statement(db,
+                        sql::insert_values(n_cols, table, this->batch_rows)));
+
+                // Carry on with the transaction which created the table, if it's still open
+                if (sqlite3_get_autocommit(db.get_ptr()))
+                    db.exec("BEGIN TRANSACTION;");
+            }
+
+            size_t get_batch_rows() const { return this->batch_rows; }
+
+            template<typename Binder>
+            void insert(size_t n_rows, Binder bind_row) {
+                /** Insert n_rows rows, where bind_row(stmt, i, offset) binds the
+                 *  i-th row to the placeholders of stmt starting at offset.
+                 *  Full batches use the multi-row statement and any
+                 *  remainder uses the single-row statement.
+                 */
+                size_t i = 0;
+                if (this->batch_stmt) {
+                    for (; i + this->batch_rows <= n_rows; i += this->batch_rows) {
+                        for (size_t j = 0; j < this->batch_rows; j++)
+                            bind_row(*this->batch_stmt, i + j, j * this->n_cols);
+                        this->batch_stmt->next();
+                    }
+                }
+
+                for (; i < n_rows; i++) {
+                    bind_row(this->insert_stmt, i, 0);
+                    this->insert_stmt.next();
+                }
+
+                this->uncommitted += n_rows;
+                this->row_count += n_rows;
+                if (this->byte_offset == Checkpoint::NO_OFFSET && this->commit_due())
+                    this->commit();
+            }
+
+            void reached(size_t byte_offset) {
+                /** Report that every record before byte_offset has been inserted */
+                this->byte_offset = byte_offset;
+                if (this->uncommitted && (this->commit_bytes || this->commit_due()))
+                    this->commit();
+            }
+
+            void finish() {
+                if (this->checkpoint)
+                    this->checkpoint->save(this->byte_offset, this->row_count);
+                this->db.exec("COMMIT;");
+            }
+
+        private:
+            bool commit_due() const {
+                return this->commit_interval && this->uncommitted >= this->commit_interval;
+            }
+
+            void commit() {
+                if (this->checkpoint)
+                    this->checkpoint->save(this->byte_offset, this->row_count);
+                this->db.exec("COMMIT;");
+                this->db.exec("BEGIN TRANSACTION;");
+                this->uncommitted = 0;
+            }
+
+            SQLite::Conn& db;
+            size_t n_cols;
+            size_t batch_rows;
+            size_t commit_interval;
+            size_t commit_bytes;
+            size_t uncommitted = 0;
+            sql::Statement insert_stmt;
+            std::unique_ptr<sql::Statement> batch_stmt;
+            Checkpoint * checkpoint;
+            size_t byte_offset;
+            size_t row_count;
+        };
+
+        /** Converts each column's fields straight to the type it was declared
+         *  with, using a converter picked once per column, instead of
+         *  re-detecting the type of every field
+         */
+        class BindPlan {
+        public:
+            BindPlan(const vector<string>& col_types, size_t n_cols) : converters(n_cols, &sql::to_text) {
+                for (size_t i = 0; i < col_types.size() && i < n_cols; i++)
+                    this->converters[i] = sql::get_converter(col_types[i]);
+            }
+
+            size_t size() const { return this->converters.size(); }
+
+            template<typename Row>
+            sql::Converted convert(Row& row, size_t i) const {
+                /** Blank fields and those missing from short rows are NULL */
+                sql::Converted out;
+                if (i < row.size()) {
+                    auto text = field_text(row, i);
+                    if (!sql::is_blank(text))
+                        this->converters[i](text, out);
+                }
+
+                return out;
+            }
+
+            template<typename Row>
+            void bind(sql::Statement& stmt, Row& row, size_t offset) const {
+                /** Bind the fields of row to stmt's placeholders starting at
+                 *  offset. Text is bound with SQLITE_STATIC, so row must be
+                 *  kept alive until the statement has been stepped.
+                 */
+                for (size_t i = 0; i < this->converters.size(); i++) {
+                    const sql::Converted value = this->convert(row, i);
+                    switch (value.type) {
+                    case SQLITE_TEXT:
+                        stmt.bind(offset + i, value.text, SQLITE_STATIC);
+                        break;
+                    case SQLITE_INTEGER:
+                        stmt.bind(offset + i, value.integer);
+                        break;
+                    case SQLITE_FLOAT:
+                        stmt.bind(offset + i, value.real);
+                        break;
+                    default:
+                        stmt.bind(offset + i, nullptr);
+                    }
+                }
+            }
+
+        private:
+            static csv::string_view field_text(CSVRow& row, size_t i) {
+                return row[i].get<csv::string_view>();
+            }
+
+            static csv::string_view field_text(const helpers::Row& row, size_t i) {
+                return row[i];
+            }
+
+            std::vector<sql::Converter> converters;
+        };
+
+        int compare_values(const sql::Converted& left, const sql::Converted& right) {
+            /** Order two converted fields the way SQLite does with the
+             *  BINARY collation: NULLs, then numbers, then text
+             */
+            auto rank = [](int type) {
+                return type == SQLITE_NULL ? 0 : (type == SQLITE_TEXT ? 2 : 1);
+            };
+
+            auto number = [](const sql::Converted& value) {
+                return value.type == SQLITE_INTEGER ? (long double)value.integer : (long double)value.real;
+            };
+
+            const int left_rank = rank(left.type), right_rank = rank(right.type);
+            if (left_rank != right_rank)
+                return left_rank < right_rank ? -1 : 1;
+
+            if (left_rank == 2)
+                return left.text.compare(right.text);
+
+            if (left.type == SQLITE_INTEGER && right.type == SQLITE_INTEGER)
+                return left.integer < right.integer ? -1 : (right.integer < left.integer ? 1 : 0);
+
+            if (left_rank == 1) {
+                const long double a = number(left), b = number(right);
+                return a < b ? -1 : (b < a ? 1 : 0);
+            }
+
+            return 0;
+        }
+
+        /** Rows converted into typed column buffers by a worker thread,
+         *  so the writer thread only has to bind them
+         */
+        struct TypedBatch {
+            struct Value {
+                int type = SQLITE_NULL; /**< SQLITE_NULL, _INTEGER, _FLOAT or _TEXT */
+                union {
+                    long long int integer;
+                    double real;
+                    size_t text_pos;    /**< Offset into TypedBatch::text */
+                };
+                size_t text_len = 0;
+            };
+
+            TypedBatch() = default;
+            TypedBatch(size_t n_cols) : columns(n_cols) {}
+
+            void append(CSVRow& row, const BindPlan& plan) {
+                for (size_t i = 0; i < this->columns.size(); i++) {
+                    const sql::Converted field = plan.convert(row, i);
+                    Value value;
+                    value.type = field.type;
+                    value.integer = 0;
+
+                    switch (field.type) {
+                    case SQLITE_TEXT:
+                        value.text_pos = this->text.size();
+                        value.text_len = field.text.size();
+                        this->text.append(field.text.data(), field.text.size());
+                        break;
+                    case SQLITE_INTEGER:
+                        value.integer = field.integer;
+                        break;
+                    case SQLITE_FLOAT:
+                        value.real = field.real;
+                    }
+
+                    this->columns[i].push_back(value);
+                }
+
+                this->n_rows++;
+            }
+
+            void bind(sql::Statement& stmt, size_t row, size_t offset) const {
+                for (size_t i = 0; i < this->columns.size(); i++) {
+                    const Value& value = this->columns[i][row];
+                    switch (value.type) {
+                    case SQLITE_TEXT:
+                        stmt.bind(offset + i, csv::string_view(
+                            this->text.data() + value.text_pos, value.text_len), SQLITE_STATIC);
+                        break;
+                    case SQLITE_INTEGER:
+                        stmt.bind(offset + i, value.integer);
+                        break;
+                    case SQLITE_FLOAT:
+                        stmt.bind(offset + i, value.real);
+                        break;
+                    default:
+                        stmt.bind(offset + i, nullptr);
+                    }
+                }
+            }
+
+            std::vector<std::vector<Value>> columns;
+            std::string text;
+            size_t n_rows = 0;
+            size_t end = 0; /**< File offset just past the last row */
+        };
+
+        void load_parallel(const string& csv_file, const CSVFormat& format, size_t start,
+            size_t chunk_size, BulkInserter& inserter, const BindPlan& plan, size_t n_threads) {
+            /** Parse and convert record-aligned chunks of csv_file, from the
+             *  record at start onwards, on n_threads worker threads, while the
+             *  calling thread writes them to SQLite in file order
+             */
+            using Range = helpers::RecordRanges::Range;
+            helpers::RecordRanges ranges(csv_file, format, chunk_size);
+            ranges.seek(start);
+
+            auto convert = [&](Range& range) {
+                TypedBatch batch(plan.size());
+                helpers::read_range(csv_file, range.first, range.second, ranges.get_format(),
+                    [&batch, &plan](CSVRow& row) { batch.append(row, plan); });
+                batch.end = range.second;
+                return batch;
+            };
+
+            auto write = [&](TypedBatch& batch) {
+                inserter.insert(batch.n_rows, [&batch](sql::Statement& stmt, size_t i, size_t offset) {
+                    batch.bind(stmt, i, offset);
+                });
+                inserter.reached(batch.end);
+            };
+
+            helpers::parallel_ordered<Range, TypedBatch>(n_threads, 2 * n_threads,
+                std::ref(ranges), convert, write);
+        }
+
+        template<typename Reader>
+        void load_rows(Reader& reader, std::deque<CSVRow>& sample,
+            BulkInserter& inserter, const BindPlan& plan) {
+            /** Insert the buffered sample, then stream the rest of reader's rows */
+
+            // Rows are held in batch until they've been inserted, since
+            // text is bound without copying
+            vector<CSVRow> batch;
+            batch.reserve(inserter.get_batch_rows());
+
+            auto flush = [&]() {
+                inserter.insert(batch.size(), [&batch, &plan](sql::Statement& stmt, size_t i, size_t offset) {
+                    plan.bind(stmt, batch[i], offset);
+                });
+                batch.clear();
+            };
+
+            auto insert_row = [&](CSVRow& row) {
+                batch.push_back(row);
+                if (batch.size() == inserter.get_batch_rows())
+                    flush();
+            };
+
+            for (auto& row: sample)
+                insert_row(row);
+            sample.clear();
+
+            CSVRow row;
+            while (reader.read_row(row))
+                insert_row(row);
+
+            flush();
+        }
+
+        void sample_ranges(helpers::RecordRanges& ranges, const string& csv_file,
+            size_t max_rows, sql::TypeSampler& sampler, std::deque<CSVRow>& sample) {
+            /** Buffer whole ranges of rows in sample until sampler has seen
+             *  max_rows of them or settled, so that load_ranges() can insert
+             *  them and carry on from the next range without parsing any
+             *  row twice
+             */
+            helpers::RecordRanges::Range range;
+            bool sampling = true;
+            while (sampling && ranges(range)) {
+                helpers::RangeReader reader(csv_file, range.first, range.second, ranges.get_format());
+                CSVRow row;
+                while (reader.read_row(row)) {
+                    sample.push_back(row);
+                    if (sampling && (sampler.add(row) || sampler.size() >= max_rows))
+                        sampling = false;
+                }
+            }
+        }
+
+        void load_ranges(helpers::RecordRanges& ranges, const string& csv_file,
+            std::deque<CSVRow>& sample, BulkInserter& inserter, const BindPlan& plan) {
+            /** Insert the sample, which holds every row before ranges' next
+             *  range, then load the rest of csv_file one range at a time, so
+             *  inserter can commit at the end of each
+             */
+            helpers::RecordRanges::Range range(ranges.tell(), ranges.tell());
+            while (!sample.empty() || ranges(range)) {
+                helpers::RangeReader reader(csv_file, range.first, range.second, ranges.get_format());
+                load_rows(reader, sample, inserter, plan);
+                inserter.reached(range.second);
+            }
+        }
+
+        /** The values of a presorted load's key columns, converted once per
+         *  row with the affinity of the column they are stored in, so that
+         *  rows sort the way the table's B-tree orders them. They are
+         *  appended to each row as an extra field, which must be dropped
+         *  before the row is bound.
+         */
+        class SortKey {
+        public:
+            SortKey(const vector<string>& col_types, const vector<size_t>& keys) : keys(keys) {
+                for (size_t i: keys)
+                    this->converters.push_back(sql::get_affinity_converter(i < col_types.size() ? col_types[i] : ""));
+            }
+
+            void append(helpers::Row& row) const {
+                /** Add the key field: a type byte for each key column, followed
+                 *  by its value if it is a number. Text is read from the row.
+                 */
+                string key;
+                for (size_t k = 0; k < this->keys.size(); k++) {
+                    const size_t i = this->keys[k];
+                    sql::Converted value;
+                    if (i < row.size() && !sql::is_blank(row[i]))
+                        this->converters[k](row[i], value);
+
+                    key += (char)value.type;
+                    if (value.type == SQLITE_INTEGER)
+                        key.append((const char *)&value.integer, sizeof(value.integer));
+                    else if (value.type == SQLITE_FLOAT)
+                        key.append((const char *)&value.real, sizeof(value.real));
+                }
+
+                row.push_back(std::move(key));
+            }
+
+            bool less(const helpers::Row& left, const helpers::Row& right) const {
+                const char * left_key = left.back().data(), * right_key = right.back().data();
+                for (size_t i: this->keys) {
+                    int cmp = compare_values(decode(left_key, left, i), decode(right_key, right, i));
+                    if (cmp) return cmp < 0;
+                }
+
+                return false;
+            }
+
+        private:
+            static sql::Converted decode(const char *& key, const helpers::Row& row, size_t i) {
+                sql::Converted value;
+                value.type = *key++;
+                if (value.type == SQLITE_TEXT) {
+                    value.text = row[i];
+                }
+                else if (value.type == SQLITE_INTEGER) {
+                    std::memcpy(&value.integer, key, sizeof(value.integer));
+                    key += sizeof(value.integer);
+                }
+                else if (value.type == SQLITE_FLOAT) {
+                    std::memcpy(&value.real, key, sizeof(value.real));
+                    key += sizeof(value.real);
+                }
+
+                return value;
+            }
+
+            vector<size_t> keys;
+            vector<sql::Converter> converters;
+        };
+
+        void load_sorted(CSVReader& reader, std::deque<CSVRow>& sample, BulkInserter& inserter,
+            const BindPlan& plan, const SortKey& sort_key, size_t memory_limit) {
+            /** Sort the sample and the rest of the file by the key columns,
+             *  spilling to disk past memory_limit, and insert the rows in
+             *  that order so the table's B-tree is only ever appended to
+             */
+            helpers::ExternalSorter sorter([&sort_key](const helpers::Row& left, const helpers::Row& right) {
+                return sort_key.less(left, right);
+            }, memory_limit);
+
+            auto push = [&sorter, &sort_key](CSVRow& row) {
+                helpers::Row fields = row;
+                sort_key.append(fields);
+                sorter.push(std::move(fields));
+            };
+
+            for (auto& row: sample)
+                push(row);
+            sample.clear();
+
+            for (auto& row: reader)
+                push(row);
+            sorter.sort();
+
+            vector<helpers::Row> batch(inserter.get_batch_rows());
+            size_t n_rows = 0;
+
+            auto flush = [&]() {
+                inserter.insert(n_rows, [&batch, &plan](sql::Statement& stmt, size_t i, size_t offset) {
+                    plan.bind(stmt, batch[i], offset);
+                });
+                n_rows = 0;
+            };
+
+            while (sorter.next(batch[n_rows])) {
+                batch[n_rows].pop_back();
+                if (++n_rows == batch.size())
+                    flush();
+            }
+
+            flush();
+        }
+
+        /** A scratch database file holding the records up to some offset
+         *  of the CSV file, deleted when this goes out of scope
+         */
+        class ShardFile {
+        public:
+            ShardFile() = default;
+            ShardFile(const string& path, size_t end) : path(path), end(end) {
+                std::remove(this->path.c_str()); // Left over from a failed load
+            }
+
+            ShardFile(ShardFile&& other) : path(std::move(other.path)), end(other.end) {
+                other.path.clear();
+            }
+
+            ShardFile& operator=(ShardFile&& other) {
+                std::swap(this->path, other.path);
+                this->end = other.end;
+                return *this;
+            }
+
+            ~ShardFile() {
+                if (!this->path.empty())
+                    std::remove(this->path.c_str());
+            }
+
+            const string& get_path() const { return this->path; }
+            size_t get_end() const { return this->end; }
+
+        private:
+            string path;
+            size_t end = 0;
+        };
+
+        void load_sharded(const string& csv_file, const CSVFormat& format, size_t start,
+            const string& db_name, SQLite::Conn& db, const string& table, const string& create_sql,
+            const BindPlan& plan, const SQLOptions& opts, Checkpoint * checkpoint, size_t row_count) {
+            /** Load record-aligned ranges of csv_file, from the record at start
+             *  onwards, into separate scratch databases next to db_name, each
+             *  on its own worker thread and connection, while the calling
+             *  thread merges finished shards into db in file order with ATTACH
+             *  and INSERT INTO ... SELECT. Each merge is committed along with
+             *  a checkpoint, if one is given.
+             */
+            using Range = helpers::RecordRanges::Range;
+
+            // Two shards per thread, so merging overlaps with loading
+            std::ifstream infile(csv_file, std::ios::binary | std::ios::ate);
+            const size_t n_shards = 2 * opts.threads;
+            const size_t remaining = (size_t)infile.tellg() - std::min((size_t)infile.tellg(), start);
+            helpers::RecordRanges ranges(csv_file, format, std::max(remaining / n_shards, (size_t)1));
+            ranges.seek(start);
+
+            auto load = [&](Range& range) {
+                ShardFile shard(db_name + "." + std::to_string(range.first) + ".shard", range.second);
+                SQLite::Conn shard_db(shard.get_path());
+
+                // Shards are thrown away if anything fails, so they
+                // don't need a journal or syncing
+                shard_db.exec(sql::pragma("journal_mode", "OFF"));
+                shard_db.exec(sql::pragma("synchronous", "OFF"));
+                shard_db.exec(create_sql);
+
+                BulkInserter inserter(shard_db, table, plan.size(), opts);
+                helpers::RangeReader reader(csv_file, range.first, range.second, ranges.get_format());
+                std::deque<CSVRow> no_sample;
+                load_rows(reader, no_sample, inserter, plan);
+                inserter.finish();
+                return shard;
+            };
+
+            auto merge = [&](ShardFile& shard) {
+                {
+                    sql::Statement attach(db, "ATTACH DATABASE ?1 AS shard;");
+                    attach.bind(0, shard.get_path());
+                    attach.next();
+                }
+
+                db.exec("BEGIN TRANSACTION;");
+                db.exec("INSERT INTO main." + table + " SELECT * FROM shard." + table + ";");
+                row_count += (size_t)sqlite3_changes(db.get_ptr());
+                if (checkpoint)
+                    checkpoint->save(shard.get_end(), row_count);
+                db.exec("COMMIT;");
+                db.exec("DETACH DATABASE shard;");
+            };
+
+            helpers::parallel_ordered<Range, ShardFile>(opts.threads, n_shards,
+                std::ref(ranges), load, merge);
+        }
+
+        void print_query(SQLite::Conn& db, const string& query, std::ostream& out) {
+            /** Run each statement in query, writing the rows of those that
+             *  return any to out as CSV, under a header of column names
+             */
+            const char * tail = query.c_str();
+            while (*tail) {
+                sqlite3_stmt * stmt = nullptr;
+                int result = sqlite3_prepare_v2(db.get_ptr(), tail, -1, &stmt, &tail);
+                _throw_on_error(result, sqlite3_errmsg(db.get_ptr()));
+                if (!stmt) continue; // Whitespace or a comment
+
+                std::unique_ptr<sqlite3_stmt, decltype(&sqlite3_finalize)> guard(stmt, &sqlite3_finalize);
+                const int n_cols = sqlite3_column_count(stmt);
+                auto writer = make_csv_writer(out);
+                vector<string> row;
+
+                for (int i = 0; i < n_cols; i++)
+                    row.push_back(sqlite3_column_name(stmt, i));
+                if (n_cols)
+                    writer.write_row(row);
+
+                while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+                    for (int i = 0; i < n_cols; i++) {
+                        auto text = (const char *)sqlite3_column_text(stmt, i);
+                        row[i] = text ? text : ""; // NULL
+                    }
+
+                    writer.write_row(row);
+                }
+
+                _throw_on_error(result, sqlite3_errmsg(db.get_ptr()));
+            }
+        }
+    }
+
+    void csv_to_sql(std::string csv_file, std::string db_name, std::string table,
+        const SQLOptions& opts) {
         /** Convert a CSV file into a SQLite3 database
             *  @param[in]  csv_file  Path to CSV file
             *  @param[out] db_name   Path to SQLite database
             *                        (will be created if it doesn't exist)
             *  @param[out] table     Name of the table (default: filename)
+            *  @param[in]  opts      Loader options
+            *
+            *  With head sampling, the sampled rows are buffered and then inserted
+            *  along with the rest of the file, so the CSV file is only read once.
+            *
+            *  Rows are inserted opts.batch_rows at a time using multi-row INSERT
+            *  statements, and committed roughly every opts.commit_interval rows
+            *  (rounded up to a whole batch), or in one transaction if it is 0.
+            *
+            *  If opts.threads > 1, parsing and type conversion happen on that
+            *  many worker threads while this thread does all of the writing.
+            *  With opts.sharded, each worker instead writes its own scratch
+            *  database next to db_name (which must be a file name, not
+            *  :memory: or a URI), and this thread only merges them into it.
+            *  Unmerged shards can need about as much disk as db_name itself.
+            *
+            *  If opts.primary_key is given, the table is created WITHOUT ROWID.
+            *  With opts.presort, rows are first sorted by the key (on one
+            *  thread) so the table is filled in key order. opts.indexes are
+            *  only built once every row has been inserted.
+            *
+            *  Loads which commit more than once record the row count (and
+            *  byte offset, when the file is read by range) reached at each
+            *  commit in a _csvsql_progress table, and opts.resume continues
+            *  an interrupted load from there. A sequential load re-reads the
+            *  rows it had already loaded; with opts.commit_bytes, it reads the
+            *  file in ranges of about that size instead, committing after
+            *  each, so that it can seek straight to where it stopped.
             */
 
         CSVReader reader(csv_file);
+        auto col_names = reader.get_col_names();
+        const bool parallel = opts.threads > 1 && !opts.presort;
 
         // Default file name is CSV file minus extension
         if (table == "") table = helpers::get_filename_from_path(csv_file);
         table = sql::sql_sanitize(table);
 
+        // Resolve the key and index columns before creating anything
+        const vector<string> sanitized = sql::sql_sanitize(col_names);
+        auto column_index = [&sanitized](const string& name) {
+            auto it = std::find(sanitized.begin(), sanitized.end(), sql::sql_sanitize(name));
+            if (it == sanitized.end())
+                throw std::runtime_error("No such column: " + name);
+            return (size_t)(it - sanitized.begin());
+        };
+
+        vector<size_t> keys;
+        for (auto& column: opts.primary_key)
+            keys.push_back(column_index(column));
+        for (auto& column: opts.indexes)
+            column_index(column);
+
+        if (opts.presort && keys.empty())
+            throw std::runtime_error("Presorting requires a primary key");
+
+        if (opts.presort && (opts.resume || opts.commit_bytes))
+            throw std::runtime_error("Presorted loads can't be resumed or committed by byte range");
+
+        // Shards are written to files named after the database
+        if (parallel && opts.sharded && (db_name.empty() || db_name == ":memory:" || db_name.compare(0, 5, "file:") == 0))
+            throw std::runtime_error("Sharded loads need the database to be a plain file name");
+
         SQLite::Conn db(db_name);
-        std::string create_query = sql::create_table(csv_file, table);
-        db.exec(create_query);
-
-        std::string insert_query = sql::insert_values(csv_file, table);
-        auto insert_stmt = db.prepare(insert_query);
-
-        for (auto& row: reader) {
-            size_t i = 0;
-            for (auto& field: row) {
-                switch (field.type()) {
-                case CSV_NULL:
-                    insert_stmt.bind(i, nullptr);
-                    break;
-                case CSV_STRING:
-                    insert_stmt.bind(i, field.get<std::string>());
-                    break;
-                case CSV_INT:
-                case CSV_LONG_INT:
-                case CSV_LONG_LONG_INT:
-                    insert_stmt.bind(i, field.get<int>());
-                    break;
-                default:
-                    insert_stmt.bind(i, field.get<double>());
-                }
+        const std::pair<const char *, const std::string&> pragmas[] = {
+            { "journal_mode", opts.journal_mode },
+            { "synchronous", opts.synchronous },
+            { "cache_size", opts.cache_size },
+            { "temp_store", opts.temp_store }
+        };
+
+        for (auto& pragma: pragmas) {
+            if (!pragma.second.empty())
+                db.exec(sql::pragma(pragma.first, pragma.second));
+        }
+
+        const bool resuming = opts.resume && table_exists(db, table);
+
+        CSVFormat format = reader.get_format();
+        format.col_names = col_names;
+
+        // Sequential loads with opts.commit_bytes read the file by range
+        // from the start, sample included
+        const bool by_range = parallel || opts.commit_bytes;
+        std::unique_ptr<helpers::RecordRanges> ranges;
+        if (by_range && !parallel)
+            ranges.reset(new helpers::RecordRanges(csv_file, format, opts.commit_bytes));
+
+        // Buffer a sample of rows for type inference
+        std::deque<CSVRow> sample;
+        vector<string> col_types;
+
+        if (resuming) {
+            col_types = declared_types(db, table);
+        }
+        else if (opts.sample_strategy == SampleStrategy::HEAD && !parallel) {
+            sql::TypeSampler sampler(col_names.size(), opts.stable_rows);
+            CSVRow row;
 
-                i++;
+            if (ranges) {
+                sample_ranges(*ranges, csv_file, opts.sample_rows, sampler, sample);
+            }
+            else {
+                while (sample.size() < opts.sample_rows && reader.read_row(row)) {
+                    sample.push_back(row);
+                    if (sampler.add(row))
+                        break;
+                }
             }
 
-            insert_stmt.next();
+            col_types = sampler.get_types();
+        }
+        else {
+            col_types = sql::sqlite_types(csv_file, opts.sample_rows,
+                opts.sample_strategy, opts.stable_rows);
         }
 
-        insert_stmt.commit();
-    }
+        // Loads which commit more than once keep a checkpoint. Those which
+        // read the file by range record byte offsets as well as row counts.
+        const bool sharded = parallel && opts.sharded;
+        std::unique_ptr<Checkpoint> checkpoint;
+        size_t byte_offset = by_range ? 0 : Checkpoint::NO_OFFSET, row_count = 0;
 
-    /**
-    void csv_join(std::string filename1, std::string filename2, std::string outfile,
-        std::string column1, std::string column2) {
+        if ((opts.commit_interval || opts.commit_bytes || sharded || opts.resume) && !opts.presort) {
+            checkpoint.reset(new Checkpoint(db, table, csv_file));
+            if (resuming) {
+                size_t saved_offset;
+                if (!checkpoint->load(saved_offset, row_count))
+                    throw std::runtime_error("Table " + table + " has no checkpoint to resume from");
 
-        // Sanitize Names
-        std::string table1 = sql::sql_sanitize(
-            helpers::get_filename_from_path(filename1));
-        std::string table2 = sql::sql_sanitize(
-            helpers::get_filename_from_path(filename2));
-        column1 = sql::sql_sanitize(column1);
-        column2 = sql::sql_sanitize(column2);
+                if (by_range && saved_offset == Checkpoint::NO_OFFSET)
+                    throw std::runtime_error("Table " + table + " was loaded row by row, so it can't be "
+                        "resumed by byte range (with threads or commit_bytes)");
+                if (by_range)
+                    byte_offset = saved_offset;
+            }
+        }
 
-        // Create SQLite Database
-        std::string db_name = "temp.sqlite";
-        csv_to_sql(filename1, db_name);
-        csv_to_sql(filename2, db_name);
+        const string create_sql = sql::create_table(col_names, col_types, table, opts.primary_key);
+        if (!resuming) {
+            // Create the table in the load's first transaction, so that a
+            // load which dies before committing leaves nothing to resume.
+            // Sharded loads commit it straight away, since shards can't be
+            // attached inside a transaction.
+            db.exec("BEGIN TRANSACTION;");
+            db.exec(create_sql);
+            if (checkpoint)
+                checkpoint->save(byte_offset, row_count);
+            if (sharded)
+                db.exec("COMMIT;");
+        }
 
-        CSVWriter writer(outfile);
-        SQLite::Conn db(db_name);
+        const size_t n_cols = std::max(col_names.size(), (size_t)1);
+        const BindPlan plan(col_types, n_cols);
 
-        // Compose Join Statement
-        char join_statement[500];
-        if (column1.empty() && column2.empty()) {
-            // No columns specified --> natural join
-            sprintf(join_statement, "SELECT * FROM %s NATURAL JOIN %s;",
-                table1.c_str(), table2.c_str());
+        if (sharded) {
+            load_sharded(csv_file, format, byte_offset, db_name, db, table, create_sql,
+                plan, opts, checkpoint.get(), row_count);
         }
         else {
-            // One or two columns specified
-            if (column2.empty())
-                column2 = column1;
-            sprintf(join_statement, "SELECT * FROM %s F1, %s F2 WHERE F1.%s = F2.%s;",
-                table1.c_str(), table2.c_str(), column1.c_str(), column2.c_str());
-        }
+            BulkInserter inserter(db, table, n_cols, opts, checkpoint.get(), byte_offset, row_count);
 
-        std::string join_statement_ = join_statement;
-        auto results = db.query(join_statement_);
-        bool write_col_names = true;
+            if (opts.presort) {
+                load_sorted(reader, sample, inserter, plan, SortKey(col_types, keys), opts.memory_limit);
+            }
+            else if (parallel) {
+                load_parallel(csv_file, format, byte_offset,
+                    opts.commit_bytes ? opts.commit_bytes : helpers::PARALLEL_CHUNK_SIZE,
+                    inserter, plan, opts.threads);
+            }
+            else if (ranges) {
+                ranges->seek(byte_offset);
+                load_ranges(*ranges, csv_file, sample, inserter, plan);
+            }
+            else {
+                // Rows which were loaded before the interruption are read
+                // again, but not inserted
+                CSVRow row;
+                for (size_t i = 0; resuming && i < row_count; i++) {
+                    if (!reader.read_row(row))
+                        break;
+                }
 
-        while (results.next()) {
-            // Write column names
-            if (write_col_names) {
-                writer.write_row(results.get_col_names());
-                write_col_names = false;
+                load_rows(reader, sample, inserter, plan);
             }
 
-            writer.write_row(results.get_row());
+            inserter.finish();
         }
 
-        db.close();
-        remove("temp.sqlite");
+        // Building each index in one pass over the loaded table is much
+        // cheaper than updating it row by row during the load
+        if (!opts.indexes.empty()) {
+            db.exec("BEGIN TRANSACTION;");
+            for (auto& column: opts.indexes)
+                db.exec(sql::create_index(table, column));
+            db.exec("COMMIT;");
+        }
     }
-    **/
-}
 
-int main(int argc, char** argv) {
-    if (argc < 3) {
-        std::cout << "Usage: " << argv[0] << " " << "[in] [out]" << std::endl;
-        exit(1);
-    }
+    bool csv_query(std::string csv_file, std::istream& queries, std::ostream& out,
+        std::string table, std::string db_name) {
+        /** Query a CSV file in place, through the csv virtual table module
+         *  @param[in]  csv_file  Path to CSV file
+         *  @param[in]  queries   SQL statements, separated by semicolons
+         *  @param[out] out       Where the results are written, as CSV
+         *  @param[in]  table     Name of the virtual table (default: filename)
+         *  @param[in]  db_name   Database the statements run in
+         *  @returns Whether every statement succeeded
+         *
+         *  Statements are run as soon as they are complete, so queries may
+         *  be typed in interactively. A statement which fails is reported
+         *  on std::cerr, and the ones after it still run.
+         */
+        if (table == "") table = helpers::get_filename_from_path(csv_file);
+        table = sql::sql_sanitize(table);
+
+        SQLite::Conn db(db_name);
+        int result = vtab::register_module(db.get_ptr());
+        _throw_on_error(result, sqlite3_errmsg(db.get_ptr()));
+        db.exec(vtab::create_virtual_table(table, csv_file));
+
+        bool succeeded = true;
+        auto run = [&](const string& statements) {
+            try {
+                print_query(db, statements, out);
+            }
+            catch (std::runtime_error& err) {
+                out.flush();
+                std::cerr << "Error: " << err.what() << std::endl;
+                succeeded = false;
+            }
+        };
+
+        string statements, line;
+        while (std::getline(queries, line)) {
+            statements += line + "\n";
+            if (sqlite3_complete(statements.c_str())) {
+                run(statements);
+                statements.clear();
+            }
+        }
+
+        // Allow the last statement to go without a semicolon
+        if (statements.find_first_not_of(" \t\r\n") != string::npos)
+            run(statements);
 
-    toolkit::csv_to_sql(argv[1], argv[2], "_table");
-    return 0;
-}
\ No newline at end of file
+        return succeeded;
+    }
+}
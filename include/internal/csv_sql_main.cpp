@@ -0,0 +1,129 @@
+#include "toolkit.h"
+#include "cli_util.hpp"
+#include <cxxopts.hpp>
+#include <iostream>
+#include <sstream>
+
+int main(int argc, char** argv) {
+    using namespace toolkit;
+
+    cxxopts::Options options(argv[0], "Load a CSV file into a SQLite database");
+    options.positional_help("[in] [out]");
+    options.add_options("required")
+        ("input", "input file", cxxopts::value<std::string>())
+        ("output", "output database (optional with --query or --shell)", cxxopts::value<std::string>());
+    options.add_options("optional")
+        ("t,table", "Name of the table (default: _table, or with --query or --shell, "
+            "the input's file name)", cxxopts::value<std::string>()->default_value(""))
+        ("q,query", "Instead of loading the file, query it in place as a virtual table "
+            "and print the results as CSV", cxxopts::value<std::string>()->default_value(""))
+        ("shell", "Like --query, but read SQL statements from standard input")
+        ("s,sample", "How to sample rows for type inference: head, random or full",
+            cxxopts::value<std::string>()->default_value("head"))
+        ("n,nrows", "Maximum number of rows to sample",
+            cxxopts::value<size_t>()->default_value(std::to_string(DEFAULT_SQL.sample_rows)))
+        ("stable", "Stop sampling after n rows without any column changing type (0: never)",
+            cxxopts::value<size_t>()->default_value(std::to_string(DEFAULT_SQL.stable_rows)))
+        ("commit-interval", "Commit every n rows, recording how far the load has got "
+            "(0: load in one transaction). With --threads, commits happen at the end of "
+            "the first chunk of the file after n rows", cxxopts::value<size_t>()->default_value("0"))
+        ("commit-bytes", "Read the file in chunks of about this size, e.g. 64M, and commit "
+            "after each one, so that --resume can seek straight to the last (0: don't). "
+            "Chunks end at line breaks outside quotes, so this needs any quotes in the "
+            "file to be balanced", cxxopts::value<std::string>()->default_value("0"))
+        ("resume", "Continue an interrupted load of the table from its last commit")
+        ("batch-rows", "Rows per INSERT statement",
+            cxxopts::value<size_t>()->default_value(std::to_string(DEFAULT_SQL.batch_rows)))
+        ("j,threads", "Parse and convert rows on n threads, with one writer thread",
+            cxxopts::value<size_t>()->default_value("1"))
+        ("sharded", "With --threads, load rows into a scratch database per thread, next "
+            "to the output, and merge them into it instead of using one writer thread. "
+            "Shards waiting to be merged can take up as much disk as the output again")
+        ("journal-mode", "PRAGMA journal_mode for the load, e.g. WAL or OFF",
+            cxxopts::value<std::string>()->default_value(""))
+        ("synchronous", "PRAGMA synchronous for the load, e.g. NORMAL or OFF",
+            cxxopts::value<std::string>()->default_value(""))
+        ("cache-size", "PRAGMA cache_size for the load (negative: KiB)",
+            cxxopts::value<std::string>()->default_value(""))
+        ("temp-store", "PRAGMA temp_store for the load, e.g. MEMORY",
+            cxxopts::value<std::string>()->default_value(""))
+        ("primary-key", "Primary key column(s) of a WITHOUT ROWID table, e.g. a,b",
+            cxxopts::value<std::string>()->default_value(""))
+        ("presort", "Sort rows by the primary key before loading them")
+        ("m,memory-limit", "With --presort, spill rows to temporary files past this "
+            "many bytes, e.g. 1G (0: no limit)",
+            cxxopts::value<std::string>()->default_value("256M"))
+        ("index", "Column(s) to index once the rows are loaded, e.g. a,b",
+            cxxopts::value<std::string>()->default_value(""));
+    options.parse_positional({ "input", "output" });
+
+    if (argc < 3) {
+        std::cout << options.help({ "optional" }) << std::endl;
+        exit(1);
+    }
+
+    try {
+        auto results = options.parse(argc, argv);
+        auto input = results["input"].as<std::string>();
+        auto output = results.count("output") ? results["output"].as<std::string>() : "";
+        auto table = results["table"].as<std::string>();
+        auto query = results["query"].as<std::string>();
+
+        if (!query.empty() || results["shell"].as<bool>()) {
+            std::istringstream query_stream(query);
+            const bool succeeded = toolkit::csv_query(input, query.empty() ? std::cin : query_stream,
+                std::cout, table, output.empty() ? ":memory:" : output);
+            return succeeded ? 0 : 1;
+        }
+
+        if (output.empty())
+            throw std::runtime_error("No output database given");
+        if (table.empty())
+            table = "_table";
+
+        SQLOptions sql_options = DEFAULT_SQL;
+        sql_options.sample_rows = results["nrows"].as<size_t>();
+        sql_options.stable_rows = results["stable"].as<size_t>();
+        sql_options.commit_interval = results["commit-interval"].as<size_t>();
+        sql_options.commit_bytes = helpers::parse_size(results["commit-bytes"].as<std::string>());
+        sql_options.resume = results["resume"].as<bool>();
+        sql_options.batch_rows = results["batch-rows"].as<size_t>();
+        sql_options.threads = results["threads"].as<size_t>();
+        sql_options.sharded = results["sharded"].as<bool>();
+        sql_options.journal_mode = results["journal-mode"].as<std::string>();
+        sql_options.synchronous = results["synchronous"].as<std::string>();
+        sql_options.cache_size = results["cache-size"].as<std::string>();
+        sql_options.temp_store = results["temp-store"].as<std::string>();
+        sql_options.presort = results["presort"].as<bool>();
+        sql_options.memory_limit = helpers::parse_size(results["memory-limit"].as<std::string>());
+
+        // Comma-separated column lists
+        for (auto& column: helpers::split(results["primary-key"].as<std::string>(), { ',' })) {
+            if (!column.empty())
+                sql_options.primary_key.push_back(column);
+        }
+
+        for (auto& column: helpers::split(results["index"].as<std::string>(), { ',' })) {
+            if (!column.empty())
+                sql_options.indexes.push_back(column);
+        }
+
+        auto strategy = results["sample"].as<std::string>();
+        if (strategy == "head")
+            sql_options.sample_strategy = SampleStrategy::HEAD;
+        else if (strategy == "random")
+            sql_options.sample_strategy = SampleStrategy::RANDOM;
+        else if (strategy == "full")
+            sql_options.sample_strategy = SampleStrategy::FULL;
+        else
+            throw std::runtime_error("Unknown sampling strategy: " + strategy);
+
+        toolkit::csv_to_sql(input, output, table, sql_options);
+    }
+    catch (std::exception& err) {
+        std::cerr << "Error: " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
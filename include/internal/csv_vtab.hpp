@@ -0,0 +1,294 @@
+#pragma once
+#include "toolkit.h"
+#include "sql_convert.hpp"
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace toolkit {
+    /** @file
+     *  A SQLite virtual table module which queries a CSV file in place,
+     *  without loading it into a database first:
+     *
+     *      CREATE VIRTUAL TABLE temp.t USING csv('file.csv');
+     *      SELECT count(*), avg(x) FROM t;
+     *
+     *  Column types come from sql::sqlite_types(), and values are converted
+     *  as if they had been stored in a table created by csv_to_sql. Only
+     *  the columns a query uses are converted.
+     */
+    namespace vtab {
+        /** A CSV file exposed as a virtual table */
+        struct CSVTable {
+            sqlite3_vtab base; /**< Must come first, since SQLite only knows about this */
+            std::string filename;
+            std::vector<sql::Converter> converters;
+            size_t file_size = 0;
+        };
+
+        /** A scan over a CSVTable */
+        struct CSVCursor {
+            sqlite3_vtab_cursor base; /**< Must come first */
+            std::unique_ptr<csv::CSVReader> reader;
+            csv::CSVRow row;
+            sqlite3_int64 rowid = 0;
+            bool eof = true;
+
+            /** Columns used by the query, and their values in the current row */
+            std::vector<size_t> used;
+            std::vector<sql::Converted> values;
+        };
+
+        inline std::string dequote(std::string arg) {
+            /** Parse a module argument, which may be 'quoted' or "quoted"
+             *  and may be given as filename=...
+             */
+            const size_t start = arg.find_first_not_of(" \t\n");
+            arg = start == std::string::npos ? "" : arg.substr(start, arg.find_last_not_of(" \t\n") - start + 1);
+
+            if (arg.compare(0, 8, "filename") == 0) {
+                const size_t equals = arg.find_first_not_of(" \t\n", 8);
+                if (equals != std::string::npos && arg[equals] == '=')
+                    return dequote(arg.substr(equals + 1));
+            }
+
+            if (arg.size() >= 2 && (arg.front() == '\'' || arg.front() == '"') && arg.back() == arg.front()) {
+                const char quote = arg.front();
+                std::string unquoted;
+                for (size_t i = 1; i + 1 < arg.size(); i++) {
+                    unquoted += arg[i];
+                    if (arg[i] == quote && arg[i + 1] == quote) i++;
+                }
+
+                return unquoted;
+            }
+
+            return arg;
+        }
+
+        inline std::string quote_identifier(const std::string& name) {
+            std::string quoted = "\"";
+            for (char ch: name) {
+                quoted += ch;
+                if (ch == '"') quoted += '"';
+            }
+
+            return quoted + "\"";
+        }
+
+        inline std::string quote_literal(const std::string& value) {
+            std::string quoted = "'";
+            for (char ch: value) {
+                quoted += ch;
+                if (ch == '\'') quoted += '\'';
+            }
+
+            return quoted + "'";
+        }
+
+        inline std::string create_virtual_table(const std::string& table, const std::string& filename) {
+            /** Generate a statement creating a temporary csv virtual table */
+            return "CREATE VIRTUAL TABLE temp." + table + " USING csv(" + quote_literal(filename) + ");";
+        }
+
+        /** The callbacks of the csv module */
+        struct CSVModule {
+            static int connect(sqlite3 * db, void *, int argc, const char * const * argv,
+                sqlite3_vtab ** vtab, char ** error) {
+                /** Open the file named by the module's argument and declare
+                 *  a column for each of its columns
+                 */
+                if (argc != 4) {
+                    *error = sqlite3_mprintf("csv: expected one argument, the CSV file's name");
+                    return SQLITE_ERROR;
+                }
+
+                std::unique_ptr<CSVTable> table(new CSVTable());
+                try {
+                    table->filename = dequote(argv[3]);
+
+                    std::ifstream infile(table->filename, std::ios::binary | std::ios::ate);
+                    if (!infile)
+                        throw std::runtime_error("Cannot open file " + table->filename);
+                    table->file_size = (size_t)infile.tellg();
+
+                    auto col_names = csv::get_col_names(table->filename);
+                    auto col_types = sql::sqlite_types(table->filename);
+
+                    std::string schema = "CREATE TABLE x(";
+                    for (size_t i = 0; i < col_names.size(); i++) {
+                        const std::string type = i < col_types.size() ? col_types[i] : "string";
+                        schema += quote_identifier(col_names[i]) + " " + type;
+                        schema += (i + 1 < col_names.size()) ? "," : "";
+                        table->converters.push_back(sql::get_affinity_converter(type));
+                    }
+
+                    schema += ")";
+
+                    int result = sqlite3_declare_vtab(db, schema.c_str());
+                    if (result != SQLITE_OK) {
+                        *error = sqlite3_mprintf("csv: %s", sqlite3_errmsg(db));
+                        return result;
+                    }
+                }
+                catch (std::exception& err) {
+                    *error = sqlite3_mprintf("csv: %s", err.what());
+                    return SQLITE_ERROR;
+                }
+
+                *vtab = &table.release()->base;
+                return SQLITE_OK;
+            }
+
+            static int disconnect(sqlite3_vtab * vtab) {
+                delete reinterpret_cast<CSVTable *>(vtab);
+                return SQLITE_OK;
+            }
+
+            static int best_index(sqlite3_vtab * vtab, sqlite3_index_info * info) {
+                /** Every scan reads the whole file, so only pass along which
+                 *  columns the query uses, for xFilter to convert
+                 */
+                auto table = reinterpret_cast<CSVTable *>(vtab);
+                info->estimatedCost = (double)table->file_size;
+
+#if SQLITE_VERSION_NUMBER >= 3010000
+                info->idxStr = sqlite3_mprintf("%llx", (unsigned long long)info->colUsed);
+                info->needToFreeIdxStr = 1;
+#endif
+                return SQLITE_OK;
+            }
+
+            static int open(sqlite3_vtab *, sqlite3_vtab_cursor ** cursor) {
+                *cursor = &(new CSVCursor())->base;
+                return SQLITE_OK;
+            }
+
+            static int close(sqlite3_vtab_cursor * cursor) {
+                delete reinterpret_cast<CSVCursor *>(cursor);
+                return SQLITE_OK;
+            }
+
+            static int filter(sqlite3_vtab_cursor * base, int, const char * idx_str, int, sqlite3_value **) {
+                /** Start a scan. idx_str is best_index()'s column usage mask:
+                 *  bit i for column i, with the last bit standing for
+                 *  every column past the 63rd. Without one, every column is used.
+                 */
+                auto cursor = reinterpret_cast<CSVCursor *>(base);
+                auto table = reinterpret_cast<CSVTable *>(base->pVtab);
+                const unsigned long long mask = idx_str ? std::strtoull(idx_str, nullptr, 16) : ~0ULL;
+
+                cursor->used.clear();
+                for (size_t i = 0; i < table->converters.size(); i++) {
+                    if (mask & (1ULL << std::min(i, (size_t)63)))
+                        cursor->used.push_back(i);
+                }
+
+                cursor->values.assign(table->converters.size(), sql::Converted());
+                cursor->rowid = 0;
+
+                try {
+                    cursor->reader.reset(new csv::CSVReader(table->filename));
+                }
+                catch (std::exception& err) {
+                    return fail(base->pVtab, err);
+                }
+
+                return next(base);
+            }
+
+            static int next(sqlite3_vtab_cursor * base) {
+                /** Read the next row and convert the fields the query uses */
+                auto cursor = reinterpret_cast<CSVCursor *>(base);
+                auto table = reinterpret_cast<CSVTable *>(base->pVtab);
+
+                try {
+                    cursor->eof = !cursor->reader->read_row(cursor->row);
+                }
+                catch (std::exception& err) {
+                    return fail(base->pVtab, err);
+                }
+
+                if (cursor->eof)
+                    return SQLITE_OK;
+
+                cursor->rowid++;
+                for (size_t i: cursor->used) {
+                    sql::Converted& value = cursor->values[i];
+                    value = sql::Converted();
+
+                    // Blank fields and those missing from short rows are NULL
+                    if (i < cursor->row.size()) {
+                        auto text = cursor->row[i].get<csv::string_view>();
+                        if (!sql::is_blank(text))
+                            table->converters[i](text, value);
+                    }
+                }
+
+                return SQLITE_OK;
+            }
+
+            static int eof(sqlite3_vtab_cursor * base) {
+                return reinterpret_cast<CSVCursor *>(base)->eof;
+            }
+
+            static int column(sqlite3_vtab_cursor * base, sqlite3_context * context, int i) {
+                const sql::Converted& value = reinterpret_cast<CSVCursor *>(base)->values[(size_t)i];
+                switch (value.type) {
+                case SQLITE_TEXT:
+                    sqlite3_result_text(context, value.text.data(), (int)value.text.size(), SQLITE_TRANSIENT);
+                    break;
+                case SQLITE_INTEGER:
+                    sqlite3_result_int64(context, (sqlite3_int64)value.integer);
+                    break;
+                case SQLITE_FLOAT:
+                    sqlite3_result_double(context, value.real);
+                    break;
+                default:
+                    sqlite3_result_null(context);
+                }
+
+                return SQLITE_OK;
+            }
+
+            static int rowid(sqlite3_vtab_cursor * base, sqlite3_int64 * rowid) {
+                *rowid = reinterpret_cast<CSVCursor *>(base)->rowid;
+                return SQLITE_OK;
+            }
+
+            static int fail(sqlite3_vtab * vtab, std::exception& err) {
+                sqlite3_free(vtab->zErrMsg);
+                vtab->zErrMsg = sqlite3_mprintf("csv: %s", err.what());
+                return SQLITE_ERROR;
+            }
+        };
+
+        inline int register_module(sqlite3 * db) {
+            /** Make the csv module available on a connection */
+            static sqlite3_module module = [] {
+                // Read-only: no xUpdate or transaction callbacks, and
+                // whatever else newer versions of SQLite add is left null
+                sqlite3_module module = {};
+                module.iVersion = 0;
+                module.xCreate = CSVModule::connect;
+                module.xConnect = CSVModule::connect;
+                module.xBestIndex = CSVModule::best_index;
+                module.xDisconnect = CSVModule::disconnect;
+                module.xDestroy = CSVModule::disconnect;
+                module.xOpen = CSVModule::open;
+                module.xClose = CSVModule::close;
+                module.xFilter = CSVModule::filter;
+                module.xNext = CSVModule::next;
+                module.xEof = CSVModule::eof;
+                module.xColumn = CSVModule::column;
+                module.xRowid = CSVModule::rowid;
+                return module;
+            }();
+
+            return sqlite3_create_module(db, "csv", &module, nullptr);
+        }
+    }
+}
@@ -0,0 +1,23 @@
+/** @file
+ *  The csv virtual table module as a loadable SQLite extension, e.g.
+ *
+ *      .load ./csvvtab
+ *      CREATE VIRTUAL TABLE temp.t USING csv('file.csv');
+ */
+
+// Route SQLite calls through the host's API table. This has to come
+// before anything else includes sqlite3.h.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+
+#include "csv_vtab.hpp"
+
+extern "C" {
+#ifdef _WIN32
+    __declspec(dllexport)
+#endif
+    int sqlite3_csvvtab_init(sqlite3 * db, char **, const sqlite3_api_routines * api) {
+        SQLITE_EXTENSION_INIT2(api);
+        return toolkit::vtab::register_module(db);
+    }
+}
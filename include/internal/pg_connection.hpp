@@ -0,0 +1,75 @@
+#pragma once
+#include "csv_postgres.hpp"
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#ifdef TOOLKIT_LIBPQ
+#include <climits>
+#include <libpq-fe.h>
+#endif
+
+namespace toolkit {
+    /** @file
+     *  Loading a CSV file straight into a server, without writing a dump
+     *  file first
+     */
+#ifdef TOOLKIT_LIBPQ
+    /** A libpq connection which runs statements and COPY FROM STDIN, for
+     *  load_postgres(). The connection is blocking, so sending COPY data
+     *  waits whenever the server falls behind instead of buffering without
+     *  bound.
+     */
+    class PGSession {
+    public:
+        PGSession(const std::string& conninfo) : conn(PQconnectdb(conninfo.c_str()), &PQfinish) {
+            if (!this->conn || PQstatus(this->conn.get()) != CONNECTION_OK)
+                throw std::runtime_error("Could not connect to Postgres: " + this->error());
+        }
+
+        void exec(const std::string& sql) {
+            this->check(PQexec(this->conn.get(), sql.c_str()), PGRES_COMMAND_OK);
+        }
+
+        void copy_begin(const std::string& table_name, PGFormat format, const std::string&) {
+            /** Start a COPY. Rows are always streamed, never read from a file. */
+            const std::string sql = "COPY \"" + table_name + "\" FROM STDIN" +
+                (format == PGFormat::BINARY ? " WITH (FORMAT binary)" : "");
+            this->check(PQexec(this->conn.get(), sql.c_str()), PGRES_COPY_IN);
+        }
+
+        void copy_data(const char * data, size_t len) {
+            while (len) {
+                const int n = (int)std::min(len, (size_t)INT_MAX);
+                if (PQputCopyData(this->conn.get(), data, n) != 1)
+                    throw std::runtime_error("COPY failed: " + this->error());
+                data += n;
+                len -= n;
+            }
+        }
+
+        void copy_end() {
+            if (PQputCopyEnd(this->conn.get(), nullptr) != 1)
+                throw std::runtime_error("COPY failed: " + this->error());
+
+            PGresult * result;
+            while ((result = PQgetResult(this->conn.get())))
+                this->check(result, PGRES_COMMAND_OK);
+        }
+
+    private:
+        std::string error() const {
+            return this->conn ? PQerrorMessage(this->conn.get()) : "out of memory";
+        }
+
+        void check(PGresult * result, ExecStatusType expected) {
+            std::unique_ptr<PGresult, decltype(&PQclear)> guard(result, &PQclear);
+            if (PQresultStatus(result) != expected)
+                throw std::runtime_error(this->error());
+        }
+
+        std::unique_ptr<PGconn, decltype(&PQfinish)> conn;
+    };
+#endif
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include <csv_parser.hpp>
+#include <sqlite_cpp.h>
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+
+namespace toolkit {
+    /** @file
+     *  Converting CSV fields straight to the SQLite type declared for
+     *  their column
+     */
+    namespace sql {
+        /** A field converted to the declared type of its column */
+        struct Converted {
+            int type = SQLITE_NULL; /**< SQLITE_NULL, _INTEGER, _FLOAT or _TEXT */
+            union {
+                long long int integer = 0;
+                double real;
+            };
+            csv::string_view text;
+        };
+
+        inline bool is_space(char ch) {
+            return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+        }
+
+        inline bool is_blank(csv::string_view text) {
+            return std::all_of(text.begin(), text.end(), is_space);
+        }
+
+        inline csv::string_view number_text(csv::string_view text) {
+            /** Strip the surrounding whitespace and leading + which
+             *  from_chars() doesn't accept
+             */
+            while (!text.empty() && is_space(text.front())) text.remove_prefix(1);
+            while (!text.empty() && is_space(text.back())) text.remove_suffix(1);
+            if (text.size() > 1 && text.front() == '+') text.remove_prefix(1);
+            return text;
+        }
+
+        inline void to_text(csv::string_view text, Converted& out) {
+            out.type = SQLITE_TEXT;
+            out.text = text;
+        }
+
+        inline void to_integer(csv::string_view text, Converted& out) {
+            /** Anything that isn't a 64-bit integer, e.g. 1.5 in a column
+             *  sampled as integers, is left as text for the column's
+             *  INTEGER affinity to deal with
+             */
+            auto num = number_text(text);
+            const char * end = num.data() + num.size();
+            auto result = std::from_chars(num.data(), end, out.integer);
+
+            if (result.ec == std::errc() && result.ptr == end)
+                out.type = SQLITE_INTEGER;
+            else
+                to_text(text, out);
+        }
+
+        inline void to_real(csv::string_view text, Converted& out) {
+            auto num = number_text(text);
+            const char * end = num.data() + num.size();
+#ifdef __cpp_lib_to_chars
+            auto result = std::from_chars(num.data(), end, out.real);
+            const bool parsed = result.ec == std::errc() && result.ptr == end;
+#else
+            const std::string copy(num);
+            char * copy_end = nullptr;
+            out.real = std::strtod(copy.c_str(), &copy_end);
+            const bool parsed = !copy.empty() && copy_end == copy.c_str() + copy.size();
+#endif
+
+            // SQLite reads inf but not nan, and would store NaN as NULL
+            if (parsed && !std::isnan(out.real))
+                out.type = SQLITE_FLOAT;
+            else
+                to_text(text, out);
+        }
+
+        inline void to_numeric(csv::string_view text, Converted& out) {
+            /** Convert text the way SQLite stores it in a column with NUMERIC
+             *  or INTEGER affinity: as an integer if it has an exact 64-bit
+             *  integer value (even if written like 3.0), otherwise as a real
+             *  if it is a number, otherwise as text
+             */
+            to_integer(text, out);
+            if (out.type != SQLITE_TEXT)
+                return;
+
+            to_real(text, out);
+            if (out.type == SQLITE_FLOAT) {
+                const double value = out.real;
+                if (value == std::trunc(value) && std::fabs(value) < 9.2e18) {
+                    out.type = SQLITE_INTEGER;
+                    out.integer = (long long int)value;
+                }
+            }
+        }
+
+        /** Converts the (non-blank) text of a field */
+        using Converter = void(*)(csv::string_view, Converted&);
+
+        inline Converter get_converter(const std::string& type) {
+            /** Pick the converter for a column type from sqlite_types() */
+            if (type == "integer")
+                return &to_integer;
+            else if (type == "float")
+                return &to_real;
+            return &to_text;
+        }
+
+        inline Converter get_affinity_converter(const std::string& type) {
+            /** Pick a converter which also applies the affinity SQLite gives a
+             *  column of this type (REAL for float and NUMERIC otherwise), for
+             *  values which never pass through a table column
+             */
+            return type == "float" ? &to_real : &to_numeric;
+        }
+    }
+}
@@ -0,0 +1,271 @@
+#include "toolkit.h"
+#include <random>
+
+using namespace csv;
+using std::vector;
+using std::string;
+
+namespace toolkit {
+    /** @file
+     *  Bounded-cost inference of SQLite column types
+     */
+    namespace sql {
+        /** Bytes read from each random offset when sampling */
+        const size_t SAMPLE_CHUNK_SIZE = 64 * 1024;
+
+        /** Maximum number of random offsets to seek to */
+        const size_t SAMPLE_CHUNKS = 64;
+
+        namespace {
+            int tally_slot(DataType type) {
+                /** Map a CSV data type onto a ColumnTally counter */
+                switch (type) {
+                case CSV_NULL:
+                    return 0;
+                case CSV_STRING:
+                    return 1;
+                case CSV_DOUBLE:
+                    return 3;
+                default:
+                    return 2;
+                }
+            }
+
+            int slot_class(int slot) {
+                /** Collapse NULL into string, which is what SQLite gets for both */
+                return slot == 0 ? 1 : slot;
+            }
+
+            const char * slot_sqlite_type(int slot) {
+                /** Map a ColumnTally counter onto a SQLite type */
+                switch (slot_class(slot)) {
+                case 2:
+                    return "integer";
+                case 3:
+                    return "float";
+                default:
+                    return "string";
+                }
+            }
+
+            size_t record_end(string_view chunk, size_t pos) {
+                /** Find the first record terminator (\n, \r or \r\n) at or
+                 *  after pos, and return the position just past it
+                 */
+                pos = chunk.find_first_of("\r\n", pos);
+                if (pos == string_view::npos)
+                    return pos;
+                if (chunk[pos] == '\r' && pos + 1 < chunk.size() && chunk[pos + 1] == '\n')
+                    pos++;
+                return pos + 1;
+            }
+
+            void sample_random(const string& filename, size_t nrows, TypeSampler& sampler) {
+                /** Feed sampler with rows parsed from chunks at random offsets
+                 *  across the file. Each chunk is trimmed to whole records, and rows
+                 *  whose width doesn't match the header (i.e. chunks that began
+                 *  inside of a quoted field) are discarded. Chunks which overlap
+                 *  one already read start where it ended, so no row is counted twice.
+                 */
+                CSVReader head(filename);
+                CSVFormat format = head.get_format();
+                format.col_names = head.get_col_names();
+                format.header = -1;
+
+                std::ifstream infile(filename, std::ios::binary | std::ios::ate);
+                const size_t file_size = (size_t)infile.tellg();
+                if (file_size == 0)
+                    return;
+
+                // Random offsets (sorted so we only ever seek forwards)
+                const size_t n_chunks = std::min(SAMPLE_CHUNKS,
+                    std::max((size_t)1, file_size / SAMPLE_CHUNK_SIZE));
+                std::mt19937_64 rng(file_size);
+                std::uniform_int_distribution<size_t> dist(0, file_size - 1);
+                vector<size_t> offsets = { 0 };
+                for (size_t i = 1; i < n_chunks; i++)
+                    offsets.push_back(dist(rng));
+                std::sort(offsets.begin(), offsets.end());
+
+                const size_t rows_per_chunk = std::max((size_t)1, nrows / n_chunks);
+                string buffer(SAMPLE_CHUNK_SIZE, '\0');
+                size_t read_to = 0; // End of the last chunk sampled, a record boundary
+
+                for (size_t offset: offsets) {
+                    const bool aligned = offset < read_to;
+                    if (aligned)
+                        offset = read_to;
+                    if (offset >= file_size)
+                        break;
+
+                    infile.clear();
+                    infile.seekg(offset);
+                    infile.read(&buffer[0], SAMPLE_CHUNK_SIZE);
+                    string_view chunk(buffer.data(), (size_t)infile.gcount());
+
+                    // Resynchronize to whole records, unless this chunk carries
+                    // on from the last one; the chunk at offset 0 starts with
+                    // the header, which is skipped the same way
+                    size_t begin = aligned ? 0 : record_end(chunk, 0);
+                    if (aligned && chunk[0] == '\n')
+                        begin = 1; // The rest of a \r\n split between chunks
+
+                    const size_t last = chunk.find_last_of("\r\n");
+                    if (begin == string_view::npos || last == string_view::npos || last < begin)
+                        continue;
+
+                    const size_t end = last + 1;
+                    chunk = chunk.substr(begin, end - begin);
+                    read_to = offset + end;
+
+                    CSVReader reader(format);
+                    reader.feed(chunk);
+                    reader.end_feed();
+
+                    CSVRow row;
+                    size_t taken = 0;
+                    while (taken < rows_per_chunk && reader.read_row(row)) {
+                        if (row.size() != format.col_names.size())
+                            continue;
+
+                        taken++;
+                        if (sampler.add(row) || sampler.size() >= nrows)
+                            return;
+                    }
+                }
+            }
+
+            void sample_head(const string& filename, size_t nrows, TypeSampler& sampler) {
+                /** Feed sampler with the first nrows rows of the file */
+                CSVReader reader(filename);
+                CSVRow row;
+                while (sampler.size() < nrows && reader.read_row(row)) {
+                    if (sampler.add(row))
+                        break;
+                }
+            }
+        }
+
+        TypeSampler::TypeSampler(size_t n_cols, size_t stable_rows) :
+            cols(n_cols), stable_rows(stable_rows) {}
+
+        bool TypeSampler::add(CSVRow& row) {
+            /** Tally the types of one row
+             *  @returns Whether every column's type has now been stable
+             *           for at least stable_rows rows
+             */
+            bool changed = false;
+
+            for (size_t i = 0; i < row.size() && i < this->cols.size(); i++) {
+                auto& col = this->cols[i];
+                int slot = tally_slot(row[i].type());
+                RowCount count = ++col.counts[slot];
+
+                if (slot != col.winner && count > col.counts[col.winner]) {
+                    if (slot_class(slot) != slot_class(col.winner))
+                        changed = true;
+                    col.winner = slot;
+                }
+            }
+
+            this->n_rows++;
+            this->rows_since_change = changed ? 0 : this->rows_since_change + 1;
+            return this->stable();
+        }
+
+        bool TypeSampler::stable() const {
+            return this->stable_rows && this->rows_since_change >= this->stable_rows;
+        }
+
+        TypeCounts TypeSampler::get_counts() const {
+            /** Return the tallies in the same format as CSVStat::get_dtypes() */
+            TypeCounts dtypes;
+            for (auto& col: this->cols) {
+                dtypes.push_back({
+                    { CSV_NULL, col.counts[0] },
+                    { CSV_STRING, col.counts[1] },
+                    { CSV_INT, col.counts[2] },
+                    { CSV_DOUBLE, col.counts[3] }
+                });
+            }
+
+            return dtypes;
+        }
+
+        vector<string> TypeSampler::get_types() const {
+            /** Return the most common SQLite type of each column */
+            vector<string> types;
+            for (auto& col: this->cols)
+                types.push_back(slot_sqlite_type(col.winner));
+            return types;
+        }
+
+        vector<string> sqlite_types(std::string filename, size_t nrows,
+            SampleStrategy strategy, size_t stable_rows) {
+            /** Return the preferred data type for the columns of a file
+            * @param[in] filename    Path to CSV file
+            * @param[in] nrows       Maximum number of rows to examine
+            * @param[in] strategy    Which rows to examine
+            * @param[in] stable_rows Stop once no column has changed type for
+            *                        this many rows (0: examine all nrows rows)
+            */
+
+            if (strategy == SampleStrategy::FULL) {
+                CSVStat stat(filename);
+                return sqlite_types(stat.get_dtypes());
+            }
+
+            TypeSampler sampler(get_col_names(filename).size(), stable_rows);
+            if (strategy == SampleStrategy::RANDOM)
+                sample_random(filename, nrows, sampler);
+
+            // Random chunks may all have come up empty, e.g. if every one
+            // began inside a long quoted field
+            if (sampler.size() == 0)
+                sample_head(filename, nrows, sampler);
+
+            return sampler.get_types();
+        }
+
+        vector<string> sqlite_types(TypeCounts dtypes) {
+            /** Return the preferred data type for each column given
+             *  a count of the data types seen in each column
+             */
+            vector<string> sqlite_types;
+
+            auto most_common_finder = [](
+                const std::pair<DataType, RowCount>& left,
+                const std::pair<DataType, RowCount>& right
+                ) { return left.second < right.second; };
+
+            // Loop over each column
+            for (auto& col: dtypes) {
+                // Aggregate integer types
+                col[CSV_INT] += col[CSV_LONG_INT] + col[CSV_LONG_LONG_INT];
+                col.erase(CSV_LONG_INT);
+                col.erase(CSV_LONG_LONG_INT);
+
+                if (col.empty()) {
+                    sqlite_types.push_back("string");
+                    continue;
+                }
+
+                DataType most_common_dtype = std::max_element(col.begin(), col.end(),
+                    most_common_finder)->first;
+
+                switch (most_common_dtype) {
+                case CSV_INT:
+                    sqlite_types.push_back("integer");
+                    break;
+                case CSV_DOUBLE:
+                    sqlite_types.push_back("float");
+                    break;
+                default:
+                    sqlite_types.push_back("string");
+                }
+            }
+
+            return sqlite_types;
+        }
+    }
+}
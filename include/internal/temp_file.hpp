@@ -0,0 +1,74 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace toolkit {
+    namespace helpers {
+        /** An anonymous temporary file, deleted when closed */
+        class TempFile {
+        public:
+            TempFile() : file(std::tmpfile(), &std::fclose) {
+                if (!this->file)
+                    throw std::runtime_error("Could not create a temporary file");
+            }
+
+            void write(const char * data, size_t n) {
+                if (n && std::fwrite(data, 1, n, this->file.get()) != n)
+                    throw std::runtime_error("Could not write to a temporary file");
+                this->written += n;
+            }
+
+            size_t size() const {
+                /** Number of bytes written so far */
+                return this->written;
+            }
+
+            size_t read(char * data, size_t n) {
+                return std::fread(data, 1, n, this->file.get());
+            }
+
+            void rewind() {
+                /** Flush any writes and go back to the start of the file */
+                if (std::fflush(this->file.get()) != 0)
+                    throw std::runtime_error("Could not write to a temporary file");
+                std::rewind(this->file.get());
+            }
+
+            template<typename OutputStream>
+            void copy_to(OutputStream& out) {
+                /** Write the entire contents of the file to out */
+                this->rewind();
+                std::vector<char> chunk(64 * 1024);
+                size_t n;
+                while ((n = this->read(chunk.data(), chunk.size())) > 0)
+                    out.write(chunk.data(), n);
+            }
+
+            template<typename OutputStream>
+            void copy_to(OutputStream& out, size_t offset, size_t length) {
+                /** Write the length bytes starting at offset to out. Once this
+                 *  has been called, the file should only be read from.
+                 */
+                if (std::fflush(this->file.get()) != 0 ||
+                    std::fseek(this->file.get(), (long)offset, SEEK_SET) != 0)
+                    throw std::runtime_error("Could not read from a temporary file");
+
+                std::vector<char> chunk(std::min(length, (size_t)64 * 1024));
+                while (length > 0) {
+                    size_t n = this->read(chunk.data(), std::min(length, chunk.size()));
+                    if (n == 0)
+                        throw std::runtime_error("Could not read from a temporary file");
+                    out.write(chunk.data(), n);
+                    length -= n;
+                }
+            }
+
+        private:
+            std::unique_ptr<FILE, decltype(&std::fclose)> file;
+            size_t written = 0;
+        };
+    }
+}
@@ -14,23 +14,92 @@
 #include <string>
 #include <vector>
 #include <deque>
+#include <memory>
 #include <math.h>
 #include <unordered_map>
 #include <set>
 
+// csv_join() used to be declared here, and is now defined in its own header
+#include "internal/csv_join.hpp"
+
 namespace toolkit {
     /** @file */
     using namespace csv;
     using CSVColumns = std::unordered_map<std::string, DataType>;
+    using TypeCounts = std::vector<std::unordered_map<DataType, RowCount>>;
+
+    /** How rows are sampled when guessing column types */
+    enum class SampleStrategy {
+        HEAD,    /**< First n rows of the file */
+        RANDOM,  /**< Chunks read from random offsets across the file */
+        FULL     /**< Every row of the file */
+    };
+
+    /** Options for loading a CSV file into SQLite */
+    struct SQLOptions {
+        SampleStrategy sample_strategy; /**< Rows used for type inference. HEAD buffers
+                                         *   the sample so the file is only read once */
+        size_t sample_rows;             /**< Maximum number of rows sampled */
+        size_t stable_rows;             /**< Stop sampling once no column has changed type
+                                         *   for this many rows (0: never stop early) */
+        size_t commit_interval;         /**< Rows per transaction (0: one transaction) */
+        size_t commit_bytes;            /**< Read the file in record-aligned ranges of about
+                                         *   this many bytes and commit after each, so
+                                         *   resume can seek to the last one (0: don't) */
+        bool resume;                    /**< Continue loading an existing table from
+                                         *   its last commit */
+        size_t batch_rows;              /**< Rows per INSERT statement, subject to
+                                         *   SQLite's host parameter limit */
+        size_t threads;                 /**< Parser threads feeding the single
+                                         *   writer (1: parse on the writer thread) */
+        bool sharded;                   /**< Have each thread write its own temporary
+                                         *   database, merged into the target at the end */
+
+        /** @name Bulk Load PRAGMAs
+         *  Applied to the connection before loading (empty: SQLite's default)
+         */
+        ///@{
+        std::string journal_mode;
+        std::string synchronous;
+        std::string cache_size;
+        std::string temp_store;
+        ///@}
+
+        std::vector<std::string> primary_key; /**< Primary key columns of a WITHOUT ROWID
+                                               *   table (empty: no primary key) */
+        bool presort;                         /**< Sort rows by primary_key before inserting
+                                               *   them, so the table is filled in key order */
+        size_t memory_limit;                  /**< presort: Bytes of rows held in memory
+                                               *   before spilling to disk (0: no limit) */
+        std::vector<std::string> indexes;     /**< Columns indexed after the rows are loaded */
+    };
+
+    const SQLOptions DEFAULT_SQL = {
+        SampleStrategy::HEAD,
+        50000,
+        10000,
+        0,
+        0,
+        false,
+        100,
+        1,
+        false,
+        "", "", "", "",
+        {},
+        false,
+        256 * 1024 * 1024,
+        {}
+    };
 
     /** @name SQLite Functions
      *  Functions built using the SQLite3 API
      */
     ///@{
     void csv_to_sql(std::string csv_file, std::string db,
-        std::string table = "");
-    void csv_join(std::string filename1, std::string filename2, std::string outfile,
-        std::string column1 = "", std::string column2 = "");
+        std::string table = "", const SQLOptions& opts = DEFAULT_SQL);
+    bool csv_query(std::string csv_file, std::istream& queries,
+        std::ostream& out = std::cout, std::string table = "",
+        std::string db = ":memory:");
     ///@}
 
     /**
@@ -38,6 +107,8 @@ namespace toolkit {
      * @brief Helper functions for various parts of the main library
      */
     namespace helpers {
+        std::vector<std::string> split(const std::string& str, const std::set<char>& delims);
+
         /** @name Path Handling */
         ///@{
         std::vector<std::string> path_split(std::string);
@@ -54,13 +125,76 @@ namespace toolkit {
         ///@{
         std::string sql_sanitize(std::string);
         std::vector<std::string> sql_sanitize(std::vector<std::string>);
-        std::vector<std::string> sqlite_types(std::string filename, int nrows = 50000);
+        std::vector<std::string> sqlite_types(std::string filename, size_t nrows = 50000,
+            SampleStrategy strategy = SampleStrategy::HEAD, size_t stable_rows = 0);
+        std::vector<std::string> sqlite_types(TypeCounts dtypes);
         ///@}
 
+        /** Incrementally tallies the data types of sampled rows and
+         *  keeps track of whether every column's type has settled
+         */
+        class TypeSampler {
+        public:
+            TypeSampler(size_t n_cols, size_t stable_rows = 0);
+            bool add(CSVRow& row);
+            bool stable() const;
+            size_t size() const { return this->n_rows; }
+            TypeCounts get_counts() const;
+            std::vector<std::string> get_types() const;
+
+        private:
+            struct ColumnTally {
+                RowCount counts[4] = { 0, 0, 0, 0 }; /**< NULL, string, integer, float */
+                int winner = 0;
+            };
+
+            std::vector<ColumnTally> cols;
+            size_t stable_rows;
+            size_t n_rows = 0;
+            size_t rows_since_change = 0;
+        };
+
         /** @name Dynamic SQL Generation */
         ///@{
         std::string create_table(std::string, std::string);
+        std::string create_table(const std::vector<std::string>& col_names,
+            const std::vector<std::string>& col_types, const std::string& table,
+            const std::vector<std::string>& primary_key = {});
+        std::string create_index(const std::string& table, const std::string& column);
         std::string insert_values(std::string, std::string);
+        std::string insert_values(size_t n_cols, const std::string& table, size_t n_rows = 1);
+        std::string pragma(const std::string& name, const std::string& value);
         ///@}
+
+        /** A prepared statement whose transactions are managed by the caller,
+         *  unlike SQLite::PreparedStatement which opens its own
+         */
+        class Statement {
+        public:
+            Statement(SQLite::Conn& db, const std::string& query);
+            Statement(const Statement&) = delete;
+            Statement& operator=(const Statement&) = delete;
+            ~Statement();
+
+            /** @name Binding
+             *  Placeholders are zero-indexed, like SQLite::PreparedStatement
+             */
+            ///@{
+            void bind(size_t i, const std::string& value);
+            void bind(size_t i, csv::string_view value,
+                sqlite3_destructor_type lifetime = SQLITE_TRANSIENT);
+            void bind(size_t i, int value);
+            void bind(size_t i, long long int value);
+            void bind(size_t i, double value);
+            void bind(size_t i, std::nullptr_t);
+            ///@}
+
+            void next();
+            sqlite3_stmt* get_ptr() { return this->stmt; }
+
+        private:
+            sqlite3* db = nullptr;
+            sqlite3_stmt* stmt = nullptr;
+        };
     }
 }
\ No newline at end of file
@@ -0,0 +1,43 @@
+#pragma once
+#include <filesystem>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+/** A uniquely named directory under the system's temporary directory, for
+ *  files written by a test. It is removed along with its contents when the
+ *  test finishes, whether or not it passed.
+ */
+class TempDir {
+public:
+    TempDir() {
+        std::random_device random;
+        const auto parent = std::filesystem::temp_directory_path();
+        for (int attempt = 0; attempt < 100; attempt++) {
+            auto dir = parent / ("csvtest-" + std::to_string(random()));
+            if (std::filesystem::create_directory(dir)) {
+                this->dir = dir;
+                return;
+            }
+        }
+
+        throw std::runtime_error("Could not create a temporary directory");
+    }
+
+    TempDir(const TempDir&) = delete;
+    TempDir& operator=(const TempDir&) = delete;
+
+    ~TempDir() {
+        std::error_code ignored;
+        std::filesystem::remove_all(this->dir, ignored);
+    }
+
+    std::string path(const std::string& name) const {
+        /** The path of a file called name in this directory */
+        return (this->dir / name).string();
+    }
+
+private:
+    std::filesystem::path dir;
+};
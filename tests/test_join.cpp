@@ -0,0 +1,177 @@
+#include "catch.hpp"
+#include "internal/csv_join.hpp"
+#include "temp_dir.hpp"
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace toolkit;
+using std::vector;
+using std::string;
+
+namespace {
+    void write_file(const string& filename, const string& contents) {
+        std::ofstream out(filename, std::ios::binary);
+        out << contents;
+    }
+
+    vector<vector<string>> read_rows(const string& filename) {
+        csv::CSVReader reader(filename);
+        vector<vector<string>> rows = { reader.get_col_names() };
+        for (auto& row: reader)
+            rows.push_back(row);
+        return rows;
+    }
+}
+
+TEST_CASE("CSV Join - Natural", "[test_join_natural]") {
+    TempDir dir;
+    write_file(dir.path("squared.csv"), "a,b\r\n1,1\r\n2,4\r\n3,9\r\n");
+    write_file(dir.path("cubed.csv"), "a,c\r\n3,27\r\n1,1\r\n4,64\r\n2,8\r\n");
+    csv_join(dir.path("squared.csv"), dir.path("cubed.csv"), dir.path("out.csv"));
+
+    auto rows = read_rows(dir.path("out.csv"));
+    std::sort(rows.begin() + 1, rows.end());
+    REQUIRE(rows == vector<vector<string>>({
+        { "a", "b", "c" },
+        { "1", "1", "1" },
+        { "2", "4", "8" },
+        { "3", "9", "27" }
+    }));
+}
+
+TEST_CASE("CSV Join - Full Outer", "[test_join_full]") {
+    TempDir dir;
+    write_file(dir.path("left.csv"), "id,name\r\n1,one\r\n2,two\r\n");
+    write_file(dir.path("right.csv"), "key,value\r\n2,b\r\n2,c\r\n3,d\r\n4,e\r\n");
+
+    JoinOptions opts = DEFAULT_JOIN;
+    opts.type = JoinType::FULL;
+    csv_join(dir.path("left.csv"), dir.path("right.csv"), dir.path("out.csv"), "id", "key", opts);
+
+    auto rows = read_rows(dir.path("out.csv"));
+    std::sort(rows.begin() + 1, rows.end());
+    REQUIRE(rows == vector<vector<string>>({
+        { "id", "name", "key", "value" },
+        { "", "", "3", "d" },
+        { "", "", "4", "e" },
+        { "1", "one", "", "" },
+        { "2", "two", "2", "b" },
+        { "2", "two", "2", "c" }
+    }));
+}
+
+TEST_CASE("CSV Join - Left", "[test_join_left]") {
+    TempDir dir;
+    write_file(dir.path("left.csv"), "id,name\r\n1,one\r\n2,two\r\n");
+    write_file(dir.path("right.csv"), "id,value\r\n2,b\r\n3,d\r\n4,e\r\n5,f\r\n");
+
+    JoinOptions opts = DEFAULT_JOIN;
+    opts.type = JoinType::LEFT;
+    csv_join(dir.path("left.csv"), dir.path("right.csv"), dir.path("out.csv"), "", "", opts);
+
+    auto rows = read_rows(dir.path("out.csv"));
+    std::sort(rows.begin() + 1, rows.end());
+    REQUIRE(rows == vector<vector<string>>({
+        { "id", "name", "value" },
+        { "1", "one", "" },
+        { "2", "two", "b" }
+    }));
+}
+
+TEST_CASE("CSV Join - Sort-Merge Matches Hash Join", "[test_join_sort_merge]") {
+    TempDir dir;
+    std::ofstream left(dir.path("left.csv")), right(dir.path("right.csv"));
+    left << "key,x\r\n";
+    right << "key,y\r\n";
+    for (int i = 0; i < 2000; i++) {
+        left << (i * 7) % 500 << "," << i << "\r\n";
+        right << (i * 13) % 700 << "," << i << "\r\n";
+    }
+    left.close();
+    right.close();
+
+    for (auto type: { JoinType::INNER, JoinType::LEFT, JoinType::FULL }) {
+        JoinOptions opts = DEFAULT_JOIN;
+        opts.type = type;
+        csv_join(dir.path("left.csv"), dir.path("right.csv"), dir.path("hash.csv"), "key", "", opts);
+
+        // Small enough to force several spilled runs per file
+        opts.memory_limit = 4096;
+        csv_join(dir.path("left.csv"), dir.path("right.csv"), dir.path("merge.csv"), "key", "", opts);
+
+        auto hash_rows = read_rows(dir.path("hash.csv")), merge_rows = read_rows(dir.path("merge.csv"));
+        REQUIRE(merge_rows.size() == hash_rows.size());
+        std::sort(hash_rows.begin() + 1, hash_rows.end());
+        std::sort(merge_rows.begin() + 1, merge_rows.end());
+        REQUIRE(merge_rows == hash_rows);
+    }
+}
+
+TEST_CASE("CSV Join - Over the Limit in Memory", "[test_join_memory_limit]") {
+    // Both files are under the limit on disk, but short fields take up far
+    // more room once parsed, so the hash join gives up part way through
+    // loading and the rows it read are sorted and merged instead
+    TempDir dir;
+    std::ofstream small(dir.path("small.csv")), large(dir.path("large.csv"));
+    small << "key,x\n";
+    large << "key,y\n";
+    for (int i = 0; i < 1500; i++)
+        small << (i * 7) % 50 << "," << i % 10 << "\n";
+    for (int i = 0; i < 3000; i++)
+        large << (i * 13) % 70 << "," << i % 10 << "\n";
+    small.close();
+    large.close();
+
+    // Either file may be the one loaded into the hash table
+    for (auto order: { vector<string>({ "small.csv", "large.csv" }), vector<string>({ "large.csv", "small.csv" }) }) {
+        JoinOptions opts = DEFAULT_JOIN;
+        opts.type = JoinType::FULL;
+        csv_join(dir.path(order[0]), dir.path(order[1]), dir.path("hash.csv"), "key", "", opts);
+
+        opts.memory_limit = 20000;
+        csv_join(dir.path(order[0]), dir.path(order[1]), dir.path("merge.csv"), "key", "", opts);
+
+        // Only a sort-merge join writes rows in key order
+        auto hash_rows = read_rows(dir.path("hash.csv")), merge_rows = read_rows(dir.path("merge.csv"));
+        REQUIRE(std::is_sorted(merge_rows.begin() + 1, merge_rows.end(),
+            [](const vector<string>& a, const vector<string>& b) {
+                return (a[0].empty() ? a[2] : a[0]) < (b[0].empty() ? b[2] : b[0]);
+            }));
+
+        std::sort(hash_rows.begin() + 1, hash_rows.end());
+        std::sort(merge_rows.begin() + 1, merge_rows.end());
+        REQUIRE(merge_rows == hash_rows);
+    }
+}
+
+TEST_CASE("CSV Join - Empty Keys", "[test_join_empty_keys]") {
+    // Empty keys are like NULLs in SQL: they never match, even each other
+    TempDir dir;
+    write_file(dir.path("left.csv"), "id,name\r\n,blank\r\n1,one\r\n");
+    write_file(dir.path("right.csv"), "id,value\r\n,b\r\n1,c\r\n");
+
+    for (size_t memory_limit: { 0, 1 }) {
+        JoinOptions opts = DEFAULT_JOIN;
+        opts.memory_limit = memory_limit; // 1: sort-merge
+        csv_join(dir.path("left.csv"), dir.path("right.csv"), dir.path("out.csv"), "id", "", opts);
+
+        auto rows = read_rows(dir.path("out.csv"));
+        REQUIRE(rows == vector<vector<string>>({
+            { "id", "name", "id", "value" },
+            { "1", "one", "1", "c" }
+        }));
+
+        opts.type = JoinType::FULL;
+        csv_join(dir.path("left.csv"), dir.path("right.csv"), dir.path("out.csv"), "id", "", opts);
+
+        rows = read_rows(dir.path("out.csv"));
+        std::sort(rows.begin() + 1, rows.end());
+        REQUIRE(rows == vector<vector<string>>({
+            { "id", "name", "id", "value" },
+            { "", "", "", "b" },
+            { "", "blank", "", "" },
+            { "1", "one", "1", "c" }
+        }));
+    }
+}
@@ -0,0 +1,170 @@
+#include "catch.hpp"
+#include "internal/csv_json.hpp"
+#include "temp_dir.hpp"
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace toolkit;
+using std::string;
+
+namespace {
+    string to_json(const string& csv_string, const JSONOptions& opts = DEFAULT_JSON) {
+        TempDir dir;
+        {
+            std::ofstream out(dir.path("in.csv"), std::ios::binary);
+            out << csv_string;
+        }
+
+        std::stringstream output;
+        csv_to_json(dir.path("in.csv"), output, opts);
+        return output.str();
+    }
+}
+
+TEST_CASE("CSV to JSON - Types", "[test_json_types]") {
+    string output = to_json(
+        "A,B,C,D\r\n"
+        "I,Like,1,2.5\r\n"
+        "I,Like,3000000000,\r\n");
+
+    REQUIRE(output ==
+        "[{\"A\":\"I\",\"B\":\"Like\",\"C\":1,\"D\":2.5},\n"
+        "{\"A\":\"I\",\"B\":\"Like\",\"C\":3000000000,\"D\":\"\"}\n]");
+}
+
+TEST_CASE("CSV to JSON - Escapes", "[test_json_escape]") {
+    string output = to_json(
+        "A,B\r\n"
+        "\"Like\"\"\",\"Like\\\"\r\n"
+        "\"Like\r\nThis\",\"Tab\tSlash/\"\r\n");
+
+    REQUIRE(output ==
+        "[{\"A\":\"Like\\\"\",\"B\":\"Like\\\\\"},\n"
+        "{\"A\":\"Like\\r\\nThis\",\"B\":\"Tab\\tSlash/\"}\n]");
+}
+
+TEST_CASE("CSV to JSON - Numbers", "[test_json_numbers]") {
+    string output = to_json(
+        "A,B,C,D\r\n"
+        "007,-0.50,1e3, 42 \r\n");
+
+    // Numbers already in JSON syntax are copied, others are reformatted
+    REQUIRE(output == "[{\"A\":7,\"B\":-0.50,\"C\":1e3,\"D\":42}\n]");
+}
+
+TEST_CASE("CSV to JSON - Column Order and Control Characters", "[test_json_order]") {
+    string output = to_json(
+        "Z,A,\"Quote\"\"d\"\r\n"
+        "\"\x01\",\"long string which is more than sixteen bytes \"\"quoted\"\"\",\r\n");
+
+    REQUIRE(output ==
+        "[{\"Z\":\"\\u0001\",\"A\":\"long string which is more than sixteen bytes \\\"quoted\\\"\","
+        "\"Quote\\\"d\":\"\"}\n]");
+}
+
+TEST_CASE("CSV to JSON - Lines", "[test_json_lines]") {
+    JSONOptions opts = DEFAULT_JSON;
+    opts.format = JSONFormat::LINES;
+
+    string output = to_json(
+        "A,B\r\n"
+        "1,\"Multi\r\nLine\"\r\n"
+        "2,Two\r\n", opts);
+
+    REQUIRE(output ==
+        "{\"A\":1,\"B\":\"Multi\\r\\nLine\"}\n"
+        "{\"A\":2,\"B\":\"Two\"}\n");
+
+    // No rows, no lines
+    REQUIRE(to_json("A,B\r\n", opts) == "");
+}
+
+TEST_CASE("CSV to JSON - Columns", "[test_json_columns]") {
+    const string csv_string =
+        "A,B,C\r\n"
+        "1,One,1.5\r\n"
+        "2,Two\r\n"
+        "3,\"Th\"\"ree\",\r\n";
+    const string expected =
+        "{\"A\":[1,2,3],\"B\":[\"One\",\"Two\",\"Th\\\"ree\"],\"C\":[1.5,null,\"\"]}";
+
+    JSONOptions opts = DEFAULT_JSON;
+    opts.format = JSONFormat::COLUMNS;
+
+    SECTION("In Memory") {
+        opts.memory_limit = 0;
+        REQUIRE(to_json(csv_string, opts) == expected);
+    }
+
+    SECTION("Spilled to Disk") {
+        opts.memory_limit = 1;
+        REQUIRE(to_json(csv_string, opts) == expected);
+    }
+}
+
+TEST_CASE("CSV to JSON - Wide Columns Spilled", "[test_json_columns_wide]") {
+    // More columns than processes are usually allowed open files, all
+    // spilled after every row
+    std::stringstream csv_string;
+    for (int row = -1; row < 20; row++) {
+        for (int col = 0; col < 3000; col++) {
+            if (col) csv_string << ",";
+            if (row < 0) csv_string << "c" << col;
+            else csv_string << row * 3000 + col;
+        }
+
+        csv_string << "\r\n";
+    }
+
+    JSONOptions opts = DEFAULT_JSON;
+    opts.format = JSONFormat::COLUMNS;
+    opts.memory_limit = 0;
+    const string expected = to_json(csv_string.str(), opts);
+    REQUIRE(expected.find("\"c2999\":[2999,5999,") != string::npos);
+
+#ifndef _WIN32
+    rlimit old_limit;
+    REQUIRE(getrlimit(RLIMIT_NOFILE, &old_limit) == 0);
+    rlimit new_limit = old_limit;
+    new_limit.rlim_cur = std::min(old_limit.rlim_cur, (rlim_t)1024);
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &new_limit) == 0);
+#endif
+
+    opts.memory_limit = 1000;
+    for (size_t threads : { 1, 4 }) {
+        opts.threads = threads;
+        REQUIRE(to_json(csv_string.str(), opts) == expected);
+    }
+
+#ifndef _WIN32
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &old_limit) == 0);
+#endif
+}
+
+TEST_CASE("CSV to JSON - Parallel", "[test_json_parallel]") {
+    // Large enough to be split into several chunks, with records
+    // spanning lines so chunk boundaries have to respect quoting
+    std::stringstream csv_string;
+    csv_string << "Int,Float,Text\r\n";
+    for (int i = 0; i < 200000; i++)
+        csv_string << i << "," << i / 8.0 << ",\"Line " << i << "\r\nContinued, \"\"quoted\"\"\"\r\n";
+
+    JSONOptions opts = DEFAULT_JSON;
+    for (auto format : { JSONFormat::ARRAY, JSONFormat::LINES, JSONFormat::COLUMNS }) {
+        opts.format = format;
+        opts.threads = 1;
+        string expected = to_json(csv_string.str(), opts);
+
+        opts.threads = 4;
+        REQUIRE(to_json(csv_string.str(), opts) == expected);
+    }
+
+    // No rows
+    opts.format = JSONFormat::ARRAY;
+    REQUIRE(to_json("A,B\r\n", opts) == "[\n]");
+}
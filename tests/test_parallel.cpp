@@ -0,0 +1,102 @@
+#include "catch.hpp"
+#include "internal/csv_parallel.hpp"
+#include "temp_dir.hpp"
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace toolkit;
+using std::string;
+using std::vector;
+
+namespace {
+    void write_file(const string& filename, const string& contents) {
+        std::ofstream out(filename, std::ios::binary);
+        out << contents;
+    }
+}
+
+TEST_CASE("Record Scanner - Line Terminators", "[test_scanner_terminators]") {
+    TempDir dir;
+    const string filename = dir.path("in.csv");
+
+    SECTION("Mixed") {
+        write_file(filename, "a\nb\r\nc\rd\r\"e\r\nf\"\rg");
+        helpers::RecordScanner scanner(filename);
+        vector<size_t> starts;
+        size_t pos;
+        while ((pos = scanner.skip(1)) < scanner.size())
+            starts.push_back(pos);
+
+        // \r\n counts once, and terminators inside quotes don't count
+        REQUIRE(starts == vector<size_t>({ 2, 5, 7, 9, 16 }));
+    }
+
+    SECTION("Carriage Return, Newline Split Between Blocks") {
+        string contents(helpers::SCAN_BLOCK_SIZE - 1, 'x');
+        contents += "\r\ny\r\nz";
+        write_file(filename, contents);
+
+        helpers::RecordScanner scanner(filename);
+        REQUIRE(scanner.skip(1) == helpers::SCAN_BLOCK_SIZE + 1);
+        REQUIRE(scanner.skip(1) == helpers::SCAN_BLOCK_SIZE + 4);
+    }
+
+    SECTION("Unbalanced Quotes") {
+        write_file(filename, "a,b\n5\" pipe,x\n1,2\n");
+        helpers::RecordScanner scanner(filename);
+        REQUIRE_THROWS(scanner.skip(3));
+    }
+}
+
+TEST_CASE("Record Ranges - Seek", "[test_ranges_seek]") {
+    TempDir dir;
+    const string filename = dir.path("in.csv");
+    string contents = "a,b\r\n";
+    for (int i = 0; i < 200; i++)
+        contents += std::to_string(i) + ",\"x\r\n" + std::to_string(i) + "\"\r\n";
+    write_file(filename, contents);
+
+    csv::CSVReader reader(filename);
+    using Range = helpers::RecordRanges::Range;
+    auto all_ranges = [&](size_t start) {
+        helpers::RecordRanges ranges(filename, reader.get_format(), 100);
+        ranges.seek(start);
+        vector<Range> result;
+        Range range;
+        while (ranges(range))
+            result.push_back(range);
+        return result;
+    };
+
+    auto ranges = all_ranges(0);
+    REQUIRE(ranges.size() > 10);
+    REQUIRE(ranges.front().first == 5);
+    REQUIRE(ranges.back().second == contents.size());
+
+    // Resuming from the end of any range hands out the same ranges after it
+    for (size_t i = 0; i < ranges.size(); i++) {
+        auto rest = all_ranges(ranges[i].second);
+        REQUIRE(rest == vector<Range>(ranges.begin() + i + 1, ranges.end()));
+    }
+
+    // Offsets inside the header are ignored
+    REQUIRE(all_ranges(2) == ranges);
+}
+
+TEST_CASE("Record Ranges - No Header", "[test_ranges_no_header]") {
+    TempDir dir;
+    const string filename = dir.path("in.csv");
+    write_file(filename, "1,a\n2,b\n3,c\n");
+
+    csv::CSVReader reader(filename);
+    csv::CSVFormat format = reader.get_format();
+    format.header = -1;
+
+    // The first record is data, so the first range starts with it
+    helpers::RecordRanges ranges(filename, format, 100);
+    helpers::RecordRanges::Range range;
+    REQUIRE(ranges(range));
+    REQUIRE(range == helpers::RecordRanges::Range(0, 12));
+    REQUIRE_FALSE(ranges(range));
+}
@@ -0,0 +1,348 @@
+#include "catch.hpp"
+#include "internal/csv_postgres.hpp"
+#include "internal/pg_connection.hpp"
+#include "temp_dir.hpp"
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace toolkit;
+using std::string;
+
+namespace {
+    string read_file(const string& filename) {
+        std::ifstream infile(filename, std::ios::binary);
+        std::stringstream contents;
+        contents << infile.rdbuf();
+        return contents.str();
+    }
+
+    string to_postgres(const string& csv_string, const PGOptions& opts = DEFAULT_PG) {
+        TempDir dir;
+        {
+            std::ofstream out(dir.path("in.csv"), std::ios::binary);
+            out << csv_string;
+        }
+
+        std::stringstream output;
+        csv_to_postgres(dir.path("in.csv"), output, opts);
+        return output.str();
+    }
+
+    /** Records what load_postgres() asks a server to do */
+    struct RecordingSession {
+        void exec(const string& sql) { this->calls.push_back("exec " + sql); }
+        void copy_begin(const string& table_name, PGFormat format, const string& data_file) {
+            this->calls.push_back("copy " + table_name + (format == PGFormat::BINARY ? " binary" : "") +
+                (data_file.empty() ? "" : " " + data_file));
+        }
+        void copy_data(const char * data, size_t len) {
+            if (this->calls.empty() || this->calls.back().compare(0, 5, "data ") != 0)
+                this->calls.push_back("data ");
+            this->calls.back().append(data, len);
+        }
+        void copy_end() { this->calls.push_back("end"); }
+
+        std::vector<string> calls;
+    };
+
+    std::vector<string> to_session(const string& csv_string, const PGOptions& opts) {
+        TempDir dir;
+        {
+            std::ofstream out(dir.path("in.csv"), std::ios::binary);
+            out << csv_string;
+        }
+
+        RecordingSession session;
+        load_postgres(dir.path("in.csv"), session, opts);
+        return session.calls;
+    }
+}
+
+TEST_CASE("CSV to Postgres - Binary COPY", "[test_pg_binary]") {
+    PGOptions opts = DEFAULT_PG;
+    opts.table_name = "Test";
+    opts.format = PGFormat::BINARY;
+
+    TempDir dir;
+    opts.data_file = dir.path("out.bin");
+
+    string script = to_postgres(
+        "Int,Float,Text\r\n"
+        "1,2.5,Tab\tHere\r\n"
+        ",,\r\n", opts);
+
+    REQUIRE(script ==
+        "CREATE TABLE IF NOT EXISTS \"Test\" (\n"
+        "\t\"Int\" bigint,\n"
+        "\t\"Float\" double precision,\n"
+        "\t\"Text\" text\n"
+        ");\n"
+        "\\copy \"Test\" FROM '" + opts.data_file + "' WITH (FORMAT binary)\n");
+
+    const char expected[] =
+        "PGCOPY\n\377\r\n\0"                     // Signature
+        "\0\0\0\0" "\0\0\0\0"                    // Flags, header extension
+        "\0\3"                                   // First row: 3 fields
+        "\0\0\0\x08" "\0\0\0\0\0\0\0\x01"        // 1
+        "\0\0\0\x08" "\x40\x04\0\0\0\0\0\0"      // 2.5
+        "\0\0\0\x08" "Tab\tHere"
+        "\0\3"                                   // Second row
+        "\xff\xff\xff\xff" "\xff\xff\xff\xff"    // NULL, NULL
+        "\xff\xff\xff\xff"                       // NULL
+        "\xff\xff";                              // Trailer
+
+    REQUIRE(read_file(opts.data_file) == string(expected, sizeof(expected) - 1));
+
+    // Without a data file, the error comes before anything is written
+    opts.data_file = "";
+    std::ofstream(dir.path("in.csv")) << "A\r\n1\r\n";
+    std::stringstream output;
+    REQUIRE_THROWS(csv_to_postgres(dir.path("in.csv"), output, opts));
+    REQUIRE(output.str().empty());
+}
+
+TEST_CASE("CSV to Postgres - Text COPY Escaping", "[test_pg_text]") {
+    PGOptions opts = DEFAULT_PG;
+    opts.table_name = "Test";
+
+    string script = to_postgres(
+        "A,B\r\n"
+        "\"Tab\tNew\r\nLine\",Back\\slash\r\n"
+        ",   \r\n"
+        "A long field without anything to escape,x\r\n", opts);
+
+    REQUIRE(script ==
+        "CREATE TABLE IF NOT EXISTS \"Test\" (\n"
+        "\t\"A\" text,\n"
+        "\t\"B\" text\n"
+        ");\n"
+        "COPY \"Test\" FROM stdin;\n"
+        "Tab\\tNew\\r\\nLine\tBack\\\\slash\n"
+        "\\N\t\\N\n"
+        "A long field without anything to escape\tx\n"
+        "\\.\n");
+}
+
+TEST_CASE("CSV to Postgres - Ragged Rows", "[test_pg_ragged]") {
+    // As in binary COPY data, every line has one field per column
+    PGOptions opts = DEFAULT_PG;
+    opts.table_name = "Test";
+
+    const string csv_string =
+        "A,B,C\r\n"
+        "1,2,3\r\n"
+        "4\r\n"
+        "5,6,7,8\r\n";
+    const string copy_data =
+        "COPY \"Test\" FROM stdin;\n"
+        "1\t2\t3\n"
+        "4\t\\N\t\\N\n"
+        "5\t6\t7\n"
+        "\\.\n";
+
+    string script = to_postgres(csv_string, opts);
+    REQUIRE(script.substr(script.find("COPY")) == copy_data);
+
+    // Rows deferred until their columns are widened are written the same way
+    opts.sample_rows = 1;
+    script = to_postgres(csv_string + "x\r\n" + "y,z,w,v\r\n", opts);
+    REQUIRE(script.find("x\t\\N\t\\N\n") != string::npos);
+    REQUIRE(script.find("y\tz\tw\n") != string::npos);
+}
+
+TEST_CASE("CSV to Postgres - Single Pass Widening", "[test_pg_single_pass]") {
+    PGOptions opts = DEFAULT_PG;
+    opts.table_name = "Test";
+    opts.sample_rows = 2;
+
+    string script = to_postgres(
+        "Int,Float,Empty,Text\r\n"
+        "1,2,,A\r\n"
+        "2,2.5,,B\r\n"
+        "3.5,3,,C\r\n"      // Doesn't fit the first column
+        "4,4,,D\r\n"
+        "5,Five,,E\r\n", opts); // Doesn't fit the second column
+
+    REQUIRE(script ==
+        "CREATE TABLE IF NOT EXISTS \"Test\" (\n"
+        "\t\"Int\" bigint,\n"
+        "\t\"Float\" double precision,\n"
+        "\t\"Empty\" text,\n"
+        "\t\"Text\" text\n"
+        ");\n"
+        "COPY \"Test\" FROM stdin;\n"
+        "1\t2\t\\N\tA\n"
+        "2\t2.5\t\\N\tB\n"
+        "4\t4\t\\N\tD\n"
+        "\\.\n"
+        "ALTER TABLE \"Test\"\n"
+        "\tALTER COLUMN \"Int\" TYPE double precision USING \"Int\"::double precision,\n"
+        "\tALTER COLUMN \"Float\" TYPE text USING \"Float\"::text;\n"
+        "COPY \"Test\" FROM stdin;\n"
+        "3.5\t3\t\\N\tC\n"
+        "5\tFive\t\\N\tE\n"
+        "\\.\n");
+
+    // Nothing to widen
+    opts.sample_rows = 10;
+    script = to_postgres("A\r\n1\r\n2\r\n", opts);
+    REQUIRE(script.find("ALTER") == string::npos);
+}
+
+TEST_CASE("CSV to Postgres - Streaming to a Server", "[test_pg_stream]") {
+    PGOptions opts = DEFAULT_PG;
+    opts.table_name = "Test";
+    opts.sample_rows = 1;
+
+    const string csv_string =
+        "A,B\r\n"
+        "1,\"Multi\r\nLine;\"\r\n"
+        "2.5,\\.\r\n";
+
+    // COPY data is sent without the \. which ends it in a dump
+    REQUIRE(to_session(csv_string, opts) == std::vector<string>({
+        "exec CREATE TABLE IF NOT EXISTS \"Test\" (\n\t\"A\" bigint,\n\t\"B\" text\n);",
+        "copy Test",
+        "data 1\tMulti\\r\\nLine;\n",
+        "end",
+        "exec ALTER TABLE \"Test\"\n\tALTER COLUMN \"A\" TYPE double precision USING \"A\"::double precision;",
+        "copy Test",
+        "data 2.5\t\\\\.\n",
+        "end"
+    }));
+
+    SECTION("Binary") {
+        // Rows are streamed, so no data file is needed
+        opts.sample_rows = 0;
+        opts.format = PGFormat::BINARY;
+
+        auto calls = to_session("A\r\n1\r\n", opts);
+        REQUIRE(calls.size() == 4);
+        REQUIRE(calls[1] == "copy Test binary");
+        REQUIRE(calls[2].substr(5, 6) == "PGCOPY");
+        REQUIRE(calls[3] == "end");
+    }
+}
+
+TEST_CASE("CSV to Postgres - Shards", "[test_pg_shards]") {
+    PGOptions opts = DEFAULT_PG;
+    opts.table_name = "Test";
+    opts.unlogged = true;
+    opts.shards = 2;
+
+    TempDir dir;
+    opts.shard_prefix = dir.path("shard");
+
+    const string csv_string =
+        "Key,Value\r\n"
+        "A,1\r\n"
+        "B,2\r\n"
+        "A,3\r\n"
+        "C,4\r\n";
+
+    SECTION("Round Robin") {
+        string script = to_postgres(csv_string, opts);
+        REQUIRE(script ==
+            "CREATE UNLOGGED TABLE IF NOT EXISTS \"Test\" (\n"
+            "\t\"Key\" text,\n"
+            "\t\"Value\" bigint\n"
+            ");\n");
+
+        REQUIRE(read_file(opts.shard_prefix + ".0.sql") == "COPY \"Test\" FROM stdin;\nA\t1\nA\t3\n\\.\n");
+        REQUIRE(read_file(opts.shard_prefix + ".1.sql") == "COPY \"Test\" FROM stdin;\nB\t2\nC\t4\n\\.\n");
+    }
+
+    SECTION("Hash") {
+        opts.sharding = PGSharding::HASH;
+        opts.shard_column = "Key";
+        to_postgres(csv_string, opts);
+
+        // Rows with the same key end up together
+        string shard0 = read_file(opts.shard_prefix + ".0.sql"), shard1 = read_file(opts.shard_prefix + ".1.sql");
+        string with_a = shard0.find("A\t1") != string::npos ? shard0 : shard1;
+        REQUIRE(with_a.find("A\t3") != string::npos);
+        REQUIRE(shard0.size() + shard1.size() == string(
+            "COPY \"Test\" FROM stdin;\nA\t1\nB\t2\nA\t3\nC\t4\n\\.\n"
+            "COPY \"Test\" FROM stdin;\n\\.\n").size());
+    }
+
+    SECTION("Binary") {
+        opts.format = PGFormat::BINARY;
+        to_postgres(csv_string, opts);
+        REQUIRE(read_file(opts.shard_prefix + ".1.sql") ==
+            "\\copy \"Test\" FROM '" + opts.shard_prefix + ".1.bin' WITH (FORMAT binary)\n");
+        REQUIRE(read_file(opts.shard_prefix + ".1.bin").compare(0, 6, "PGCOPY") == 0);
+    }
+
+    SECTION("Bad Options") {
+        std::ofstream(dir.path("in.csv")) << csv_string;
+
+        // Nothing is written before the options are found to be unusable
+        for (int i = 0; i < 3; i++) {
+            PGOptions bad = opts;
+            bad.sharding = PGSharding::HASH;
+            if (i == 0) bad.sample_rows = 100;
+            if (i == 1) bad.shard_prefix = "";
+            if (i == 2) bad.shard_column = "Missing";
+
+            std::stringstream output;
+            REQUIRE_THROWS(csv_to_postgres(dir.path("in.csv"), output, bad));
+            REQUIRE(output.str().empty());
+        }
+    }
+}
+
+TEST_CASE("CSV to Postgres - Skip Lines", "[test_pg_skiplines]") {
+    PGOptions opts = DEFAULT_PG;
+    opts.table_name = "Test";
+    opts.skiplines = 3;
+
+    // Skipped rows don't count towards type inference either
+    string script = to_postgres(
+        "A,B\r\n"
+        "Skipped,\"Multi\r\nLine\"\r\n"
+        "Skipped,\"Quoted \"\"Newline\r\n\"\"\"\r\n"
+        "Skipped,x\r\n"
+        "1,One\r\n"
+        "2,Two\r\n", opts);
+
+    REQUIRE(script ==
+        "CREATE TABLE IF NOT EXISTS \"Test\" (\n"
+        "\t\"A\" bigint,\n"
+        "\t\"B\" text\n"
+        ");\n"
+        "COPY \"Test\" FROM stdin;\n"
+        "1\tOne\n"
+        "2\tTwo\n"
+        "\\.\n");
+
+    // Skipping past the end of the file
+    opts.skiplines = 100;
+    REQUIRE(to_postgres("A\r\n1\r\n", opts).find("COPY \"Test\" FROM stdin;\n\\.\n") != string::npos);
+}
+
+TEST_CASE("CSV to Postgres - Carriage Returns", "[test_pg_cr]") {
+    PGOptions opts = DEFAULT_PG;
+    opts.table_name = "Test";
+
+    const string expected =
+        "CREATE TABLE IF NOT EXISTS \"Test\" (\n"
+        "\t\"A\" bigint,\n"
+        "\t\"B\" text\n"
+        ");\n"
+        "COPY \"Test\" FROM stdin;\n"
+        "1\tOne\n"
+        "2\tTwo\n"
+        "\\.\n";
+
+    // Old Mac line endings, with and without skipping
+    REQUIRE(to_postgres("A,B\r1,One\r2,Two\r", opts) == expected);
+
+    opts.skiplines = 2;
+    REQUIRE(to_postgres("A,B\rSkipped,\"Multi\rLine\"\rSkipped,\r\n1,One\r2,Two\r", opts) == expected);
+
+    // A stray quote leaves the scan inside a quoted field at the end of the file
+    REQUIRE_THROWS(to_postgres("A,B\rSkipped,5\" pipe\rSkipped,x\r1,One\r", opts));
+}
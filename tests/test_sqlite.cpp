@@ -0,0 +1,352 @@
+#include "catch.hpp"
+#include "toolkit.h"
+#include "temp_dir.hpp"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace toolkit;
+using std::string;
+using std::vector;
+
+namespace {
+    string write_rows(const string& filename, size_t n_rows) {
+        /** Write a file with a column of each type, and some blank fields,
+         *  and return its contents
+         */
+        std::ostringstream contents;
+        contents << "id,name,value\r\n";
+        for (size_t i = 0; i < n_rows; i++) {
+            contents << i << ",\"name " << i % 97 << "\",";
+            if (i % 13) contents << i * 0.5;
+            contents << "\r\n";
+        }
+
+        std::ofstream out(filename, std::ios::binary);
+        out << contents.str();
+        return contents.str();
+    }
+
+    void interrupt(const string& db_name, size_t row_count, const string& byte_offset) {
+        /** Make a finished load look like one which died after committing
+         *  its first row_count rows
+         */
+        SQLite::Conn db(db_name);
+        db.exec("DELETE FROM data WHERE rowid > " + std::to_string(row_count) + ";");
+        db.exec("UPDATE _csvsql_progress SET row_count = " + std::to_string(row_count) +
+            ", byte_offset = " + byte_offset + ";");
+    }
+
+    vector<string> select_rows(const string& db_name, const string& query) {
+        /** Each row of a query's results, with the type of each value */
+        SQLite::Conn db(db_name);
+        sql::Statement stmt(db, query);
+        vector<string> rows;
+
+        while (sqlite3_step(stmt.get_ptr()) == SQLITE_ROW) {
+            string row;
+            for (int i = 0; i < sqlite3_column_count(stmt.get_ptr()); i++) {
+                auto text = sqlite3_column_text(stmt.get_ptr(), i);
+                row += std::to_string(sqlite3_column_type(stmt.get_ptr(), i)) + ":";
+                row += (text ? (const char *)text : "") + string("|");
+            }
+
+            rows.push_back(row);
+        }
+
+        return rows;
+    }
+}
+
+TEST_CASE("CSV to SQL - Head Sample", "[test_sql_head_sample]") {
+    // The sampled rows are buffered and inserted ahead of the rest of the
+    // file, so nothing is lost or loaded twice however sampling ends. (A
+    // small sample may give value NUMERIC rather than REAL affinity, so
+    // values are compared as reals.)
+    TempDir dir;
+    write_rows(dir.path("in.csv"), 3000);
+    const string query = "SELECT rowid, id, name, value * 1.0 FROM data;";
+
+    SQLOptions opts = DEFAULT_SQL;
+    opts.sample_strategy = SampleStrategy::FULL;
+    csv_to_sql(dir.path("in.csv"), dir.path("expected.db"), "data", opts);
+    auto expected = select_rows(dir.path("expected.db"), query);
+    REQUIRE(expected.size() == 3000);
+
+    opts.sample_strategy = SampleStrategy::HEAD;
+    for (size_t sample_rows: { 1, 100, 2999, 3000, 5000 }) {
+        for (size_t stable_rows: { 0, 10 }) {
+            const string db_name = dir.path(
+                "head" + std::to_string(sample_rows) + "_" + std::to_string(stable_rows) + ".db");
+            opts.sample_rows = sample_rows;
+            opts.stable_rows = stable_rows;
+            csv_to_sql(dir.path("in.csv"), db_name, "data", opts);
+            REQUIRE(select_rows(db_name, query) == expected);
+        }
+    }
+}
+
+TEST_CASE("Multi-Row INSERT", "[test_sql_insert_values]") {
+    REQUIRE(sql::insert_values(2, "t") == "INSERT INTO t VALUES (?,?);");
+    REQUIRE(sql::insert_values(2, "t", 3) == "INSERT INTO t VALUES (?,?),(?,?),(?,?);");
+}
+
+TEST_CASE("CSV to SQL - Batch Sizes", "[test_sql_batch_rows]") {
+    TempDir dir;
+    SQLOptions opts = DEFAULT_SQL;
+
+    SECTION("Partial Batches") {
+        // 1234 rows leave a remainder for the single-row statement with
+        // every batch size but 1
+        write_rows(dir.path("in.csv"), 1234);
+        opts.batch_rows = 1;
+        csv_to_sql(dir.path("in.csv"), dir.path("expected.db"), "data", opts);
+        auto expected = select_rows(dir.path("expected.db"), "SELECT rowid, * FROM data;");
+        REQUIRE(expected.size() == 1234);
+
+        for (size_t batch_rows: { 7, 100 }) {
+            const string db_name = dir.path("batch" + std::to_string(batch_rows) + ".db");
+            opts.batch_rows = batch_rows;
+            csv_to_sql(dir.path("in.csv"), db_name, "data", opts);
+            REQUIRE(select_rows(db_name, "SELECT rowid, * FROM data;") == expected);
+        }
+    }
+
+    SECTION("Wide Table") {
+        // 1000 rows of 1000 columns would need more host parameters than
+        // SQLite allows in one statement, so batches are made smaller
+        std::ofstream out(dir.path("wide.csv"), std::ios::binary);
+        for (int row = -1; row < 600; row++) {
+            for (int col = 0; col < 1000; col++) {
+                if (col) out << ",";
+                if (row < 0) out << "c" << col;
+                else out << row * 1000 + col;
+            }
+
+            out << "\n";
+        }
+
+        out.close();
+        opts.batch_rows = 1000;
+        csv_to_sql(dir.path("wide.csv"), dir.path("wide.db"), "data", opts);
+        REQUIRE(select_rows(dir.path("wide.db"), "SELECT count(*), sum(c0), max(c999) FROM data;") ==
+            vector<string>({ "1:600|1:179700000|1:599999|" }));
+    }
+}
+
+TEST_CASE("CSV to SQL - 64-bit Integers", "[test_sql_int64]") {
+    TempDir dir;
+    std::ofstream(dir.path("in.csv"), std::ios::binary) << "id,big\n"
+        "1,9000000000\n"
+        "2,-9000000000\n"
+        "3,2147483648\n"
+        "4,4611686018427387905\n";
+
+    // Stored as integers, exactly: a double would round the last one
+    csv_to_sql(dir.path("in.csv"), dir.path("data.db"), "data");
+    REQUIRE(select_rows(dir.path("data.db"), "SELECT big, big - 1 FROM data;") == vector<string>({
+        "1:9000000000|1:8999999999|",
+        "1:-9000000000|1:-9000000001|",
+        "1:2147483648|1:2147483647|",
+        "1:4611686018427387905|1:4611686018427387904|"
+    }));
+
+    // Binding directly
+    SQLite::Conn db(dir.path("data.db"));
+    {
+        sql::Statement insert(db, "INSERT INTO data VALUES (6, ?);");
+        insert.bind(0, 9000000000LL);
+        insert.next();
+    }
+
+    REQUIRE(select_rows(dir.path("data.db"), "SELECT big FROM data WHERE id = 6;") ==
+        vector<string>({ "1:9000000000|" }));
+}
+
+TEST_CASE("CSV to SQL - Column Binding", "[test_sql_bind]") {
+    // Types come from the first two rows, and the rest are converted to
+    // fit them, or left for the column's affinity to deal with
+    TempDir dir;
+    std::ofstream(dir.path("in.csv"), std::ios::binary) << "i,r,t\n"
+        "1,1.5,a\n"
+        "2,2.5,b\n"
+        " +3 ,3,x7\n"
+        "4.5,x,c\n"
+        ",  ,\t\n"
+        "6\n";
+
+    SQLOptions opts = DEFAULT_SQL;
+    opts.sample_strategy = SampleStrategy::HEAD;
+    opts.sample_rows = 2;
+
+    for (size_t threads: { 1, 2 }) {
+        const string db_name = dir.path("data" + std::to_string(threads) + ".db");
+        opts.threads = threads;
+        csv_to_sql(dir.path("in.csv"), db_name, "data", opts);
+
+        REQUIRE(select_rows(db_name, "SELECT typeof(i), i, typeof(r), r, typeof(t), t FROM data;") ==
+            vector<string>({
+                "3:integer|1:1|3:real|2:1.5|3:text|3:a|",
+                "3:integer|1:2|3:real|2:2.5|3:text|3:b|",
+                "3:integer|1:3|3:real|2:3.0|3:text|3:x7|",
+                "3:real|2:4.5|3:text|3:x|3:text|3:c|",
+                "3:null|5:|3:null|5:|3:null|5:|",   // Blank fields are NULL
+                "3:integer|1:6|3:null|5:|3:null|5:|" // So are missing ones
+            }));
+    }
+}
+
+TEST_CASE("CSV to SQL - Presorted Primary Key", "[test_sql_presort]") {
+    // Keys in shuffled order, after a text one which samples the column
+    // as a string, so that it has NUMERIC affinity: 10 sorts after 9, and
+    // text after every number
+    TempDir dir;
+    const int n_rows = 20000;
+    {
+        std::ofstream out(dir.path("in.csv"), std::ios::binary);
+        out << "k,v\nkey,first\n";
+        for (int i = 0; i < n_rows; i++) {
+            const int k = (int)((long long)i * 7919 % n_rows);
+            out << k << ",value " << k % 100 << "\n";
+        }
+    }
+
+    SQLOptions opts = DEFAULT_SQL;
+    opts.sample_rows = 1;
+    opts.primary_key = { "k" };
+    opts.indexes = { "v" };
+    opts.presort = true;
+    opts.memory_limit = 16 * 1024; // Many spilled runs
+    const string db_name = dir.path("data.db");
+    csv_to_sql(dir.path("in.csv"), db_name, "data", opts);
+
+    REQUIRE(select_rows(db_name, "SELECT type, name, sql FROM sqlite_master ORDER BY name;") == vector<string>({
+        "3:table|3:data|3:CREATE TABLE data (k string,v string,PRIMARY KEY (k)) WITHOUT ROWID|",
+        "3:index|3:data_v_idx|3:CREATE INDEX data_v_idx ON data (v)|"
+    }));
+
+    auto keys = select_rows(db_name, "SELECT k FROM data ORDER BY k;");
+    REQUIRE(keys.size() == n_rows + 1);
+    REQUIRE(vector<string>(keys.begin() + 8, keys.begin() + 12) == vector<string>({ "1:8|", "1:9|", "1:10|", "1:11|" }));
+    REQUIRE(keys.back() == "3:key|");
+
+    // Rows were inserted in key order, so the table was only ever appended
+    // to, and its leaf pages were allocated in key order too
+    if (sqlite3_compileoption_used("ENABLE_DBSTAT_VTAB")) {
+        auto pages = select_rows(db_name,
+            "SELECT pageno FROM dbstat WHERE name = 'data' AND pagetype = 'leaf' ORDER BY path;");
+        REQUIRE(pages.size() > 10);
+        REQUIRE(std::is_sorted(pages.begin(), pages.end(), [](const string& left, const string& right) {
+            return std::stoi(left.substr(2)) < std::stoi(right.substr(2));
+        }));
+    }
+}
+
+TEST_CASE("CSV to SQL - Parallel Load", "[test_sql_parallel]") {
+    TempDir dir;
+    write_rows(dir.path("in.csv"), 5000);
+
+    csv_to_sql(dir.path("in.csv"), dir.path("sequential.db"), "data");
+    auto expected = select_rows(dir.path("sequential.db"), "SELECT rowid, * FROM data;");
+    REQUIRE(expected.size() == 5000);
+
+    // Ranges are inserted in file order, so the rowids match too
+    SQLOptions opts = DEFAULT_SQL;
+    opts.threads = 4;
+    csv_to_sql(dir.path("in.csv"), dir.path("parallel.db"), "data", opts);
+    REQUIRE(select_rows(dir.path("parallel.db"), "SELECT rowid, * FROM data;") == expected);
+
+    // Many small ranges, so every thread gets several
+    opts.commit_bytes = 4096;
+    csv_to_sql(dir.path("in.csv"), dir.path("ranges.db"), "data", opts);
+    REQUIRE(select_rows(dir.path("ranges.db"), "SELECT rowid, * FROM data;") == expected);
+}
+
+TEST_CASE("CSV to SQL - Sharded Load", "[test_sql_sharded]") {
+    TempDir dir;
+    write_rows(dir.path("in.csv"), 5000);
+
+    csv_to_sql(dir.path("in.csv"), dir.path("sequential.db"), "data");
+
+    SQLOptions opts = DEFAULT_SQL;
+    opts.threads = 4;
+    opts.sharded = true;
+    csv_to_sql(dir.path("in.csv"), dir.path("sharded.db"), "data", opts);
+
+    // Shards are merged in file order, so the rowids match too
+    auto expected = select_rows(dir.path("sequential.db"), "SELECT rowid, * FROM data;");
+    REQUIRE(expected.size() == 5000);
+    REQUIRE(select_rows(dir.path("sharded.db"), "SELECT rowid, * FROM data;") == expected);
+
+    // Shards are written next to the database, so it must be a file
+    REQUIRE_THROWS(csv_to_sql(dir.path("in.csv"), ":memory:", "data", opts));
+    REQUIRE_THROWS(csv_to_sql(dir.path("in.csv"), "file:" + dir.path("uri.db"), "data", opts));
+}
+
+TEST_CASE("CSV to SQL - Resume", "[test_sql_resume]") {
+    TempDir dir;
+    const string contents = write_rows(dir.path("in.csv"), 3000);
+    csv_to_sql(dir.path("in.csv"), dir.path("expected.db"), "data");
+    const auto expected = select_rows(dir.path("expected.db"), "SELECT rowid, * FROM data;");
+
+    // Where the 1001st row starts
+    size_t row_1000 = 0;
+    for (int i = 0; i < 1001; i++)
+        row_1000 = contents.find("\r\n", row_1000) + 2;
+
+    SQLOptions opts = DEFAULT_SQL;
+    opts.commit_interval = 100;
+    opts.sample_rows = 500;
+    const string db_name = dir.path("data.db");
+
+    SECTION("Row by Row") {
+        csv_to_sql(dir.path("in.csv"), db_name, "data", opts);
+        REQUIRE(select_rows(db_name,
+            "SELECT table_name, byte_offset, row_count, file_size FROM _csvsql_progress;") ==
+            vector<string>({ "3:data|5:|1:3000|1:" + std::to_string(contents.size()) + "|" }));
+
+        interrupt(db_name, 1000, "NULL");
+        opts.resume = true;
+        csv_to_sql(dir.path("in.csv"), db_name, "data", opts);
+        REQUIRE(select_rows(db_name, "SELECT rowid, * FROM data;") == expected);
+
+        // Without a byte offset, threads can't pick up where it left off
+        interrupt(db_name, 1000, "NULL");
+        opts.threads = 2;
+        REQUIRE_THROWS(csv_to_sql(dir.path("in.csv"), db_name, "data", opts));
+    }
+
+    SECTION("By Byte Range") {
+        opts.commit_bytes = 4096;
+        csv_to_sql(dir.path("in.csv"), db_name, "data", opts);
+        REQUIRE(select_rows(db_name, "SELECT rowid, * FROM data;") == expected);
+        REQUIRE(select_rows(db_name, "SELECT byte_offset, row_count FROM _csvsql_progress;") ==
+            vector<string>({ "1:" + std::to_string(contents.size()) + "|1:3000|" }));
+
+        for (size_t threads: { 1, 4 }) {
+            interrupt(db_name, 1000, std::to_string(row_1000));
+            opts.resume = true;
+            opts.threads = threads;
+            csv_to_sql(dir.path("in.csv"), db_name, "data", opts);
+            REQUIRE(select_rows(db_name, "SELECT rowid, * FROM data;") == expected);
+        }
+    }
+
+    SECTION("Changed File") {
+        csv_to_sql(dir.path("in.csv"), db_name, "data", opts);
+        interrupt(db_name, 1000, "NULL");
+        write_rows(dir.path("in.csv"), 3001);
+
+        opts.resume = true;
+        REQUIRE_THROWS(csv_to_sql(dir.path("in.csv"), db_name, "data", opts));
+    }
+
+    SECTION("Nothing Committed") {
+        // A table which doesn't exist yet is just loaded
+        opts.resume = true;
+        csv_to_sql(dir.path("in.csv"), db_name, "data", opts);
+        REQUIRE(select_rows(db_name, "SELECT rowid, * FROM data;") == expected);
+    }
+}
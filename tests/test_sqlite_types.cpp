@@ -0,0 +1,86 @@
+#include "catch.hpp"
+#include "toolkit.h"
+#include "temp_dir.hpp"
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace toolkit;
+using std::string;
+using std::vector;
+
+namespace {
+    void write_rows(const string& filename, const string& newline, size_t n_ints, size_t n_rows) {
+        /** A file whose first column holds integers for n_ints rows and
+         *  text after that, and whose second column is always a float
+         */
+        std::ofstream out(filename, std::ios::binary);
+        out << "a,b" << newline;
+        for (size_t i = 0; i < n_rows; i++) {
+            if (i < n_ints)
+                out << i;
+            else
+                out << "text " << i;
+            out << "," << i << ".5" << newline;
+        }
+    }
+}
+
+TEST_CASE("Type Sampler - Stable Rows", "[test_type_sampler]") {
+    TempDir dir;
+    write_rows(dir.path("in.csv"), "\n", 20, 40);
+
+    CSVReader reader(dir.path("in.csv"));
+    sql::TypeSampler sampler(2, 5);
+    CSVRow row;
+
+    // The first row settles both columns, and five more keep them there
+    for (int i = 0; i < 5; i++) {
+        REQUIRE(reader.read_row(row));
+        REQUIRE_FALSE(sampler.add(row));
+    }
+
+    REQUIRE(reader.read_row(row));
+    REQUIRE(sampler.add(row));
+    REQUIRE(sampler.size() == 6);
+    REQUIRE(sampler.get_types() == vector<string>({ "integer", "float" }));
+
+    // Without stable_rows, sampling never stops early
+    sql::TypeSampler unbounded(2);
+    while (reader.read_row(row))
+        REQUIRE_FALSE(unbounded.add(row));
+
+    // More text than integers
+    REQUIRE(unbounded.get_types() == vector<string>({ "string", "float" }));
+}
+
+TEST_CASE("SQLite Types - Sampling Strategies", "[test_sqlite_types_strategies]") {
+    TempDir dir;
+
+    // Enough rows for many random chunks, with the first column's text
+    // far past the head of the file
+    const vector<std::pair<string, string>> newlines = {
+        { "Newline", "\n" }, { "Carriage Return, Newline", "\r\n" }, { "Carriage Return", "\r" }
+    };
+
+    for (auto& newline: newlines) {
+        SECTION(newline.first) {
+            write_rows(dir.path("in.csv"), newline.second, 1000, 100000);
+
+            REQUIRE(sql::sqlite_types(dir.path("in.csv"), 500, SampleStrategy::HEAD) ==
+                vector<string>({ "integer", "float" }));
+            REQUIRE(sql::sqlite_types(dir.path("in.csv"), 5000, SampleStrategy::RANDOM) ==
+                vector<string>({ "string", "float" }));
+            REQUIRE(sql::sqlite_types(dir.path("in.csv"), 500, SampleStrategy::FULL) ==
+                vector<string>({ "string", "float" }));
+        }
+    }
+
+    SECTION("Nothing Sampled at Random") {
+        // The only row has no terminator, so no chunk holds a whole
+        // record and the head of the file is sampled instead
+        std::ofstream(dir.path("in.csv"), std::ios::binary) << "a,b\r1,2.5";
+        REQUIRE(sql::sqlite_types(dir.path("in.csv"), 500, SampleStrategy::RANDOM) ==
+            vector<string>({ "integer", "float" }));
+    }
+}
@@ -0,0 +1,142 @@
+#include "catch.hpp"
+#include "internal/csv_vtab.hpp"
+#include "temp_dir.hpp"
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace toolkit;
+using std::string;
+using std::vector;
+
+namespace {
+    void write_file(const string& filename, const string& contents) {
+        std::ofstream out(filename, std::ios::binary);
+        out << contents;
+    }
+
+    string convert(sql::Converter converter, const string& text) {
+        /** A converted field as "type:value" */
+        sql::Converted value;
+        converter(text, value);
+        switch (value.type) {
+        case SQLITE_INTEGER:
+            return "integer:" + std::to_string(value.integer);
+        case SQLITE_FLOAT:
+            return "real:" + std::to_string(value.real);
+        case SQLITE_TEXT:
+            return "text:" + string(value.text);
+        default:
+            return "null:";
+        }
+    }
+
+    vector<string> select_rows(SQLite::Conn& db, const string& query) {
+        /** Each row of a query's results, with the type of each value */
+        sql::Statement stmt(db, query);
+        vector<string> rows;
+
+        while (sqlite3_step(stmt.get_ptr()) == SQLITE_ROW) {
+            string row;
+            for (int i = 0; i < sqlite3_column_count(stmt.get_ptr()); i++) {
+                auto text = sqlite3_column_text(stmt.get_ptr(), i);
+                row += std::to_string(sqlite3_column_type(stmt.get_ptr(), i)) + ":";
+                row += (text ? (const char *)text : "") + string("|");
+            }
+
+            rows.push_back(row);
+        }
+
+        return rows;
+    }
+
+    void open_csv(SQLite::Conn& db, const string& filename) {
+        /** Make filename available on db as the virtual table t */
+        REQUIRE(vtab::register_module(db.get_ptr()) == SQLITE_OK);
+        db.exec(vtab::create_virtual_table("t", filename));
+    }
+}
+
+TEST_CASE("Affinity Conversion", "[test_vtab_affinity]") {
+    // As SQLite stores them in a NUMERIC column
+    REQUIRE(convert(sql::to_numeric, "3") == "integer:3");
+    REQUIRE(convert(sql::to_numeric, " +3 ") == "integer:3");
+    REQUIRE(convert(sql::to_numeric, "3.0") == "integer:3");
+    REQUIRE(convert(sql::to_numeric, "1e3") == "integer:1000");
+    REQUIRE(convert(sql::to_numeric, "1.5") == "real:1.500000");
+    REQUIRE(convert(sql::to_numeric, "1e30") == "real:" + std::to_string(1e30));
+    REQUIRE(convert(sql::to_numeric, "nan") == "text:nan");
+    REQUIRE(convert(sql::to_numeric, "007 Bond") == "text:007 Bond");
+
+    // As SQLite stores them in a REAL column
+    REQUIRE(convert(sql::get_affinity_converter("float"), "3") == "real:3.000000");
+    REQUIRE(convert(sql::get_affinity_converter("float"), "nan") == "text:nan");
+    REQUIRE(convert(sql::get_affinity_converter("string"), "3.0") == "integer:3");
+}
+
+TEST_CASE("Module Arguments", "[test_vtab_dequote]") {
+    REQUIRE(vtab::dequote("file.csv") == "file.csv");
+    REQUIRE(vtab::dequote(" 'file.csv' ") == "file.csv");
+    REQUIRE(vtab::dequote("\"file.csv\"") == "file.csv");
+    REQUIRE(vtab::dequote("'it''s.csv'") == "it's.csv");
+    REQUIRE(vtab::dequote("filename='file.csv'") == "file.csv");
+    REQUIRE(vtab::dequote("filename = \"a\"\"b.csv\"") == "a\"b.csv");
+
+    // Only an argument of the form filename=... is unwrapped
+    REQUIRE(vtab::dequote("filenames.csv") == "filenames.csv");
+}
+
+TEST_CASE("Virtual Table - Compared to a Load", "[test_vtab_load]") {
+    TempDir dir;
+    const string filename = dir.path("in.csv");
+    string contents = "id,name,value,code\r\n";
+    for (int i = 0; i < 200; i++) {
+        contents += std::to_string(i) + ",name " + std::to_string(i % 7) + ",";
+        if (i % 11) contents += std::to_string(i * 0.25);
+        contents += "," + string(i % 3 ? "3.0" : "x" + std::to_string(i)) + "\r\n";
+    }
+
+    // A row with only some of the columns
+    contents += "200,short\r\n";
+    write_file(filename, contents);
+
+    csv_to_sql(filename, dir.path("loaded.db"), "t");
+    SQLite::Conn loaded(dir.path("loaded.db"));
+    SQLite::Conn db(":memory:");
+    open_csv(db, filename);
+
+    // Each column on its own, so that the others aren't converted
+    for (string column: { "id", "name", "value", "code", "*" }) {
+        const string query = "SELECT rowid, " + column + " FROM t;";
+        REQUIRE(select_rows(db, query) == select_rows(loaded, query));
+    }
+
+    REQUIRE(select_rows(db, "SELECT typeof(value), typeof(code) FROM t WHERE id = 200;") ==
+        vector<string>({ "3:null|3:null|" }));
+    REQUIRE(select_rows(db, "SELECT sum(value) FROM t;") == select_rows(loaded, "SELECT sum(value) FROM t;"));
+}
+
+TEST_CASE("Virtual Table - Many Columns", "[test_vtab_columns]") {
+    // Columns past the 63rd share the last bit of the usage mask
+    TempDir dir;
+    const string filename = dir.path("wide.csv");
+    string contents;
+    for (int row = -1; row < 3; row++) {
+        for (int col = 0; col < 70; col++) {
+            if (col) contents += ",";
+            contents += row < 0 ? "c" + std::to_string(col) : std::to_string(row * 100 + col);
+        }
+
+        contents += "\n";
+    }
+
+    write_file(filename, contents);
+    SQLite::Conn db(":memory:");
+    open_csv(db, filename);
+
+    REQUIRE(select_rows(db, "SELECT c0, c62, c63, c64, c69 FROM t;") == vector<string>({
+        "1:0|1:62|1:63|1:64|1:69|", "1:100|1:162|1:163|1:164|1:169|", "1:200|1:262|1:263|1:264|1:269|"
+    }));
+    REQUIRE(select_rows(db, "SELECT c68 FROM t WHERE c1 = 101;") == vector<string>({ "1:168|" }));
+    REQUIRE(select_rows(db, "SELECT sum(c65) FROM t;") == vector<string>({ "1:495|" }));
+}